@@ -0,0 +1,178 @@
+/* -----------------------------------------
+	Accélérateur optionnel de pyshell
+	construction des trames, checksum et décodage des réponses DMAC/BMAC
+	mêmes résultats que les versions Python de pyshell.py
+	compilation: python setup.py build_ext --inplace
+	-----------------------------------------
+*/
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <string.h>
+
+#define STX 0x02
+#define ETX 0x03
+#define ACK 0x06
+#define XOFF 0x18
+#define XON 0x1a
+
+static const char HEX[] = "0123456789ABCDEF";
+
+static unsigned int
+somme(const unsigned char *data, Py_ssize_t n)
+{
+    unsigned int s = 0;
+    Py_ssize_t i;
+    for (i = 0; i < n; i++)
+        s += data[i];
+    return s % 256;
+}
+
+/*
+checksum(data) -> int
+somme des octets modulo 256
+*/
+static PyObject *
+accel_checksum(PyObject *self, PyObject *arg)
+{
+    Py_buffer buf;
+    unsigned int s;
+
+    if (PyObject_GetBuffer(arg, &buf, PyBUF_SIMPLE) < 0)
+        return NULL;
+    s = somme(buf.buf, buf.len);
+    PyBuffer_Release(&buf);
+    return PyLong_FromUnsignedLong(s);
+}
+
+/*
+encode_frame(commande, address=None) -> bytes
+[STX][SIZ1][SIZ2][SIZ3][ADR1][ADR2][CMD1]...[CMDn][CHK1][CHK2][ETX]
+*/
+static PyObject *
+accel_encode_frame(PyObject *self, PyObject *args)
+{
+    PyObject *commande, *address = Py_None, *majuscules, *ascii, *trame;
+    char adresse[24] = "", siz[24];
+    Py_ssize_t n_adr = 0, n_siz, n_cmd, n;
+    unsigned int s;
+    char *p;
+
+    if (!PyArg_ParseTuple(args, "U|O:encode_frame", &commande, &address))
+        return NULL;
+    if (address != Py_None) {
+        long a = PyLong_AsLong(address);
+        if (a == -1 && PyErr_Occurred())
+            return NULL;
+        n_adr = snprintf(adresse, sizeof(adresse), "%02ld", a);
+    }
+
+    /* même conversion en majuscules que str.upper() */
+    majuscules = PyObject_CallMethod(commande, "upper", NULL);
+    if (majuscules == NULL)
+        return NULL;
+    ascii = PyUnicode_AsASCIIString(majuscules);
+    Py_DECREF(majuscules);
+    if (ascii == NULL)
+        return NULL;
+
+    n_cmd = PyBytes_GET_SIZE(ascii);
+    n = n_adr + n_cmd;
+    n_siz = snprintf(siz, sizeof(siz), "%03zd", n);
+    trame = PyBytes_FromStringAndSize(NULL, 1 + n_siz + n + 2 + 1);
+    if (trame == NULL) {
+        Py_DECREF(ascii);
+        return NULL;
+    }
+    p = PyBytes_AS_STRING(trame);
+    *p++ = STX;
+    memcpy(p, siz, n_siz);
+    p += n_siz;
+    memcpy(p, adresse, n_adr);
+    memcpy(p + n_adr, PyBytes_AS_STRING(ascii), n_cmd);
+    s = somme((unsigned char *)p, n);
+    p += n;
+    *p++ = HEX[s >> 4];
+    *p++ = HEX[s & 0x0f];
+    *p = ETX;
+    Py_DECREF(ascii);
+    return trame;
+}
+
+/*
+decode_reply(reponse) -> str
+"COM ERROR", "SYNTAX ERROR", "OK" ou les données de la réponse
+*/
+static PyObject *
+accel_decode_reply(PyObject *self, PyObject *arg)
+{
+    Py_buffer buf;
+    const char *d;
+    Py_ssize_t n, debut, fin;
+    PyObject *resultat;
+
+    if (PyObject_GetBuffer(arg, &buf, PyBUF_SIMPLE) < 0)
+        return NULL;
+    d = buf.buf;
+    n = buf.len;
+    if (memchr(d, ACK, n) == NULL)
+        resultat = PyUnicode_FromString("COM ERROR");
+    else if (memchr(d, XOFF, n) != NULL)
+        resultat = PyUnicode_FromString("SYNTAX ERROR");
+    else if (memchr(d, XON, n) == NULL)
+        resultat = PyUnicode_FromString("OK");
+    else {
+        /* reponse[6:-4] */
+        debut = n < 6 ? n : 6;
+        fin = n < 4 ? 0 : n - 4;
+        if (fin < debut)
+            fin = debut;
+        resultat = PyUnicode_DecodeASCII(d + debut, fin - debut, NULL);
+    }
+    PyBuffer_Release(&buf);
+    return resultat;
+}
+
+/*
+reply_status(reponse) -> str
+"SERIAL EXCEPTION" (None), "COM ERROR", "SYNTAX ERROR", "OK" ou "DATA"
+*/
+static PyObject *
+accel_reply_status(PyObject *self, PyObject *arg)
+{
+    Py_buffer buf;
+    const char *statut;
+
+    if (arg == Py_None)
+        return PyUnicode_FromString("SERIAL EXCEPTION");
+    if (PyObject_GetBuffer(arg, &buf, PyBUF_SIMPLE) < 0)
+        return NULL;
+    if (memchr(buf.buf, ACK, buf.len) == NULL)
+        statut = "COM ERROR";
+    else if (memchr(buf.buf, XOFF, buf.len) != NULL)
+        statut = "SYNTAX ERROR";
+    else if (memchr(buf.buf, XON, buf.len) == NULL)
+        statut = "OK";
+    else
+        statut = "DATA";
+    PyBuffer_Release(&buf);
+    return PyUnicode_FromString(statut);
+}
+
+static PyMethodDef accel_methods[] = {
+    {"checksum", accel_checksum, METH_O, "somme des octets modulo 256"},
+    {"encode_frame", accel_encode_frame, METH_VARARGS, "construction d'une trame de commande"},
+    {"decode_reply", accel_decode_reply, METH_O, "interprétation d'une réponse du module"},
+    {"reply_status", accel_reply_status, METH_O, "résultat d'un échange"},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef accel_module = {
+    PyModuleDef_HEAD_INIT, "_pyshell_accel", "accélérateur optionnel de pyshell", -1, accel_methods
+};
+
+PyMODINIT_FUNC
+PyInit__pyshell_accel(void)
+{
+    return PyModule_Create(&accel_module);
+}
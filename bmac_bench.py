@@ -0,0 +1,362 @@
+#!/usr/bin/env python
+# -*- coding:utf-8 -*-
+
+""" -----------------------------------------
+	Banc de mesure des performances de pyshell
+	latence aller-retour et débit de BMAC face au simulateur bmac_sim
+	-----------------------------------------
+"""
+
+# utilisation:
+#   python bmac_bench.py                              mesure à tous les débits
+#   python bmac_bench.py --save bench/baseline.json   enregistre une référence
+#   python bmac_bench.py --check bench/baseline.json  échoue (code 1) en cas de régression
+
+import argparse
+import asyncio
+import json
+import logging
+import sys
+import time
+from collections import Counter
+
+import serial.serialposix
+
+import bmac_sim
+import pyshell
+from pyshell import percentile
+
+BAUDRATES = [9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600]
+MODES = ['send', 'send_many', 'submit', 'async']
+COMMAND = "READ #POS"
+
+
+"""
+envoi de n commandes selon le mode choisi; renvoie les latences (s) et le nombre d'erreurs
+"""
+def run_mode(mode, bmac, n, command=COMMAND):
+    latences = []
+    erreurs = 0
+    if mode == 'send':
+        for i in range(n):
+            t = time.perf_counter()
+            reponse = bmac.send(command)
+            latences.append(time.perf_counter() - t)
+            erreurs += reponse.endswith("ERROR") or reponse == "SERIAL EXCEPTION"
+    elif mode == 'send_many':
+        for r in bmac.send_many([command] * n):
+            latences.append(r.elapsed)
+            erreurs += r.reply.endswith("ERROR") or r.reply == "SERIAL EXCEPTION"
+    elif mode == 'submit':
+        debuts = []
+        futures = []
+        for i in range(n):
+            debuts.append(time.perf_counter())
+            f = bmac.submit(command)
+            f.add_done_callback(lambda f, k=i: latences.append(time.perf_counter() - debuts[k]))
+            futures.append(f)
+        for f in futures:
+            reponse = f.result()
+            erreurs += reponse.endswith("ERROR") or reponse == "SERIAL EXCEPTION"
+        bmac.bus.stop()
+    elif mode == 'async':
+        async def une_commande():
+            t = time.perf_counter()
+            reponse = await bmac.send(command)
+            latences.append(time.perf_counter() - t)
+            return reponse
+        async def toutes():
+            return await asyncio.gather(*[une_commande() for i in range(n)])
+        for reponse in asyncio.run(toutes()):
+            erreurs += reponse.endswith("ERROR") or reponse == "SERIAL EXCEPTION"
+    return latences, erreurs
+
+
+"""
+mesure d'un mode à un débit donné, face à un simulateur neuf
+"""
+def bench_one(mode, baudrate, n, timing=True, turnaround=0.0005):
+    module = bmac_sim.Module(0, {COMMAND.split()[1]: 123456}, turnaround=turnaround)
+    with bmac_sim.Simulator([module], baudrate, timing=timing) as sim:
+        classe = pyshell.AsyncBMAC if mode == 'async' else pyshell.BMAC
+        bmac = classe(sim.port, baudrate=baudrate, address=0)
+        try:
+            debut = time.perf_counter()
+            latences, erreurs = run_mode(mode, bmac, n)
+            duree = time.perf_counter() - debut
+        finally:
+            if mode == 'async':
+                bmac.close()
+            else:
+                bmac.bus.close()
+        latences.sort()
+        return {
+            'mode': mode,
+            'baudrate': baudrate,
+            'commands': n,
+            'errors': erreurs,
+            'commands_per_s': n / duree,
+            'p50_ms': percentile(latences, 50) * 1000,
+            'p95_ms': percentile(latences, 95) * 1000,
+            'p99_ms': percentile(latences, 99) * 1000,
+            'bytes_per_command': (sim.rx_bytes + sim.tx_bytes) / n,
+        }
+
+
+def bench(modes, baudrates, n, timing=True, turnaround=0.0005):
+    resultats = {}
+    for baudrate in baudrates:
+        for mode in modes:
+            r = bench_one(mode, baudrate, n, timing, turnaround)
+            resultats[f"{mode}@{baudrate}"] = r
+            print(f"{mode:>9} {baudrate:>7} bauds: {r['commands_per_s']:9.1f} cmd/s  "
+                  f"p50 {r['p50_ms']:7.3f} ms  p95 {r['p95_ms']:7.3f} ms  p99 {r['p99_ms']:7.3f} ms  "
+                  f"{r['bytes_per_command']:5.1f} B/cmd  {r['errors']} err")
+    return resultats
+
+
+"""
+débit avant et après négociation du débit de la ligne (Bus.negotiate_baudrate)
+"""
+def bench_negotiate(n, baudrate=115200, turnaround=0.0005):
+    module = bmac_sim.Module(0, {COMMAND.split()[1]: 123456}, turnaround=turnaround)
+    resultats = {}
+    with bmac_sim.Simulator([module], baudrate) as sim:
+        bmac = pyshell.BMAC(sim.port, baudrate=baudrate, address=0)
+        try:
+            for etape in ('before', 'after'):
+                if etape == 'after':
+                    bmac.negotiate_baudrate()
+                debut = time.perf_counter()
+                latences, erreurs = run_mode('send', bmac, n)
+                duree = time.perf_counter() - debut
+                latences.sort()
+                resultats[f"negotiate_{etape}"] = r = {
+                    'baudrate': bmac.baudrate,
+                    'errors': erreurs,
+                    'commands_per_s': n / duree,
+                    'p50_ms': percentile(latences, 50) * 1000,
+                    'p95_ms': percentile(latences, 95) * 1000,
+                }
+                print(f"{etape:>6} {r['baudrate']:>7} bauds: {r['commands_per_s']:9.1f} cmd/s  "
+                      f"p50 {r['p50_ms']:7.3f} ms  p95 {r['p95_ms']:7.3f} ms  {erreurs} err")
+        finally:
+            bmac.bus.close()
+    return resultats
+
+
+class SyscallCounter:
+    """
+    compte les appels système faits par pyserial et pyshell (Linux): les modules
+    os, select, fcntl et termios vus par serial.serialposix et pyshell sont
+    remplacés le temps du bloc with
+    """
+    CALLS = {'os': ('read', 'write', 'readv'), 'select': ('select',), 'fcntl': ('ioctl',), 'termios': ('tcflush',)}
+    MODULES = (serial.serialposix, pyshell)
+
+    def __init__(self):
+        self.counts = Counter()
+        self._saved = []
+
+    def __enter__(self):
+        for cible in self.MODULES:
+            for nom, fonctions in self.CALLS.items():
+                module = getattr(cible, nom, None)
+                if module != None:
+                    self._saved.append((cible, nom, module))
+                    setattr(cible, nom, _Counting(module, fonctions, self.counts))
+        return self
+
+    def __exit__(self, *exc):
+        for cible, nom, module in reversed(self._saved):
+            setattr(cible, nom, module)
+        self._saved = []
+
+    def total(self):
+        return sum(self.counts.values())
+
+
+class _Counting:
+    def __init__(self, module, fonctions, counts):
+        self._module = module
+        for nom in fonctions:
+            if hasattr(module, nom):
+                setattr(self, nom, self._wrap(nom, getattr(module, nom), counts))
+
+    @staticmethod
+    def _wrap(nom, fn, counts):
+        def appel(*args):
+            counts[nom] += 1
+            return fn(*args)
+        return appel
+
+    def __getattr__(self, nom):
+        return getattr(self._module, nom)
+
+
+"""
+appels système par commande send, avec la purge systématique des tampons avant
+chaque échange (comportement d'origine) puis avec la resynchronisation sur anomalie
+"""
+def bench_syscalls(n, baudrate=115200, turnaround=0.0005):
+    module = bmac_sim.Module(0, {COMMAND.split()[1]: 123456}, turnaround=turnaround)
+    resultats = {}
+    with bmac_sim.Simulator([module], baudrate) as sim:
+        bmac = pyshell.BMAC(sim.port, baudrate=baudrate, address=0)
+        execute = pyshell.Bus._execute
+        def purge_puis_execute(bus, t):
+            bus.ser.reset_input_buffer()
+            bus.ser.reset_output_buffer()
+            execute(bus, t)
+        try:
+            for etape in ('flush', 'resync'):
+                bmac.bus._execute = purge_puis_execute.__get__(bmac.bus) if etape == 'flush' else execute.__get__(bmac.bus)
+                with SyscallCounter() as compteur:
+                    debut = time.perf_counter()
+                    latences, erreurs = run_mode('send', bmac, n)
+                    duree = time.perf_counter() - debut
+                latences.sort()
+                resultats[f"syscalls_{etape}"] = r = {
+                    'errors': erreurs,
+                    'syscalls_per_command': compteur.total() / n,
+                    'calls': {k: v / n for k, v in compteur.counts.items()},
+                    'commands_per_s': n / duree,
+                    'p50_ms': percentile(latences, 50) * 1000,
+                }
+                detail = "  ".join(f"{k} {v / n:.2f}" for k, v in sorted(compteur.counts.items()))
+                print(f"{etape:>6}: {r['syscalls_per_command']:5.2f} syscalls/cmd ({detail})  "
+                      f"{r['commands_per_s']:9.1f} cmd/s  p50 {r['p50_ms']:7.3f} ms  {erreurs} err")
+        finally:
+            bmac.bus.close()
+    return resultats
+
+
+"""
+vérification de RetryPolicy: classification des commandes et, face au simulateur
+dont le premier acquittement est perdu, absence de second envoi d'un déplacement;
+renvoie la liste des écarts
+"""
+def check_retry():
+    attendu = {
+        "READ #POS": ('read', None, None),
+        "WRITE #SPEED 200": ('write', '#SPEED', '200'),
+        "#SPEED=200": ('write', '#SPEED', '200'),
+        "MOVE 100": ('unsafe', None, None),
+        "JOG +10": ('unsafe', None, None),
+        "STOP 1": ('unsafe', None, None),
+        "HOME": ('unsafe', None, None),
+        "WRITE SPEED 200": ('unsafe', None, None),
+    }
+    policy = pyshell.RetryPolicy()
+    ecarts = [f"classify({c!r}) = {policy.classify(c)}, expected {e}"
+              for c, e in attendu.items() if policy.classify(c) != e]
+    envois = []
+    def move(module, commande):
+        envois.append(commande)
+        return None if len(envois) == 1 else bmac_sim.ACK_REPLY    # premier acquittement perdu
+    module = bmac_sim.Module(0, handlers={'MOVE ': move})
+    with bmac_sim.Simulator([module], 115200) as sim:
+        bmac = pyshell.BMAC(sim.port, address=0, timeout=0.05, retry=policy)
+        try:
+            reponse = bmac.send("MOVE 100")
+        finally:
+            bmac.bus.close()
+    if reponse != "COM ERROR" or len(envois) != 1:
+        ecarts.append(f"MOVE 100 with lost ACK: {reponse}, sent {len(envois)} times")
+    for e in ecarts:
+        print("RETRY " + e)
+    return ecarts
+
+
+"""
+comparaison des versions Python et compilée de la construction/décodage des trames
+"""
+def bench_codec(n=200000):
+    try:
+        import _pyshell_accel
+    except ImportError:
+        print("_pyshell_accel not built (python setup.py build_ext --inplace)")
+        return {}
+    reponse = b'\x06\x1a\x02006123456' + b'00\x03\n'
+    cas = [
+        ('encode_frame', pyshell.py_encode_frame, _pyshell_accel.encode_frame, ("READ #POS", 1)),
+        ('decode_reply', pyshell.py_decode_reply, _pyshell_accel.decode_reply, (reponse,)),
+        ('checksum', pyshell.py_checksum, _pyshell_accel.checksum, (b'01READ #POS',)),
+    ]
+    resultats = {}
+    for nom, py, natif, args in cas:
+        assert py(*args) == natif(*args)
+        durees = []
+        for fn in (py, natif):
+            t = time.perf_counter()
+            for i in range(n):
+                fn(*args)
+            durees.append(time.perf_counter() - t)
+        resultats[nom] = {'python_ns': durees[0] / n * 1e9, 'native_ns': durees[1] / n * 1e9}
+        print(f"{nom:>13}: python {durees[0] / n * 1e9:7.1f} ns  native {durees[1] / n * 1e9:7.1f} ns  "
+              f"x{durees[0] / durees[1]:.1f}")
+    return resultats
+
+
+"""
+comparaison avec une référence: liste des régressions au-delà de la tolérance relative
+"""
+def compare(resultats, reference, tolerance=0.2):
+    regressions = []
+    for cle, ref in reference.items():
+        r = resultats.get(cle)
+        if r == None:
+            continue
+        if r['commands_per_s'] < ref['commands_per_s'] * (1 - tolerance):
+            regressions.append(f"{cle}: {r['commands_per_s']:.1f} cmd/s < {ref['commands_per_s']:.1f}")
+        if r['p95_ms'] > ref['p95_ms'] * (1 + tolerance):
+            regressions.append(f"{cle}: p95 {r['p95_ms']:.3f} ms > {ref['p95_ms']:.3f}")
+        if r['errors'] > ref['errors']:
+            regressions.append(f"{cle}: {r['errors']} errors > {ref['errors']}")
+    return regressions
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="mesure des performances de pyshell face au simulateur")
+    parser.add_argument("--baud", type=int, nargs="+", default=BAUDRATES)
+    parser.add_argument("--mode", nargs="+", choices=MODES, default=MODES)
+    parser.add_argument("-n", type=int, default=200, help="nombre de commandes par mesure")
+    parser.add_argument("--turnaround", type=float, default=0.5, help="temps de traitement du module simulé (ms)")
+    parser.add_argument("--no-timing", action="store_true", help="simulateur sans temps de ligne (coût du driver seul)")
+    parser.add_argument("--json", help="écriture des résultats dans ce fichier")
+    parser.add_argument("--save", help="enregistrement des résultats comme référence")
+    parser.add_argument("--check", help="comparaison avec cette référence")
+    parser.add_argument("--negotiate", action="store_true", help="mesure avant/après négociation du débit depuis 115200 bauds")
+    parser.add_argument("--syscalls", action="store_true", help="appels système par commande, purge systématique puis resynchronisation sur anomalie")
+    parser.add_argument("--retry", action="store_true", help="vérifie seulement la classification et la reprise des commandes (RetryPolicy)")
+    parser.add_argument("--codec", action="store_true", help="compare seulement les versions Python et compilée du codage des trames")
+    parser.add_argument("--tolerance", type=float, default=0.2, help="écart relatif toléré (0.2 = 20%%)")
+    args = parser.parse_args()
+
+    logging.basicConfig(level=logging.ERROR)
+
+    if args.retry:
+        sys.exit(1 if check_retry() else 0)
+    if args.codec:
+        bench_codec()
+        sys.exit(0)
+    if args.syscalls:
+        bench_syscalls(args.n, turnaround=args.turnaround / 1000)
+        sys.exit(0)
+    if args.negotiate:
+        bench_negotiate(args.n, turnaround=args.turnaround / 1000)
+        sys.exit(0)
+
+    resultats = bench(args.mode, args.baud, args.n, not args.no_timing, args.turnaround / 1000)
+
+    for fichier in (args.json, args.save):
+        if fichier:
+            with open(fichier, 'w') as f:
+                json.dump(resultats, f, indent=2, sort_keys=True)
+
+    if args.check:
+        with open(args.check) as f:
+            regressions = compare(resultats, json.load(f), args.tolerance)
+        for r in regressions:
+            print("REGRESSION " + r)
+        sys.exit(1 if regressions else 0)
@@ -0,0 +1,156 @@
+#!/usr/bin/env python
+# -*- coding:utf-8 -*-
+
+""" -----------------------------------------
+	Rejeu d'une capture pyshell (voir pyshell.Capture)
+	renvoie les trames enregistrées au rythme d'origine (ou accéléré)
+	vers un module simulé qui répond comme le module enregistré,
+	ou vers un port série réel
+	-----------------------------------------
+"""
+
+# utilisation:
+#   python bmac_replay.py terrain.bmcap                  rejeu face aux réponses enregistrées
+#   python bmac_replay.py terrain.bmcap --speed 10       10 fois plus vite (0: sans attente)
+#   python bmac_replay.py terrain.bmcap --port COM3      rejeu vers un port réel
+#   python bmac_replay.py terrain.bmcap --serve          faux module seul, pour un autre driver
+
+import argparse
+import logging
+import sys
+import time
+
+import pyshell
+from pyshell import percentile
+
+SYNTAX_REPLY = b'\x06\x18'
+
+
+class ReplayModule:
+    """
+    module simulé (pour bmac_sim.Simulator) qui rejoue les réponses enregistrées
+    pour son adresse: chaque commande reçoit la réponse suivante enregistrée pour
+    la même commande (la dernière est répétée une fois la liste épuisée), après le
+    temps de traitement observé lors de l'enregistrement (durée de l'échange moins
+    le temps de ligne de la trame et de la réponse au débit baudrate)
+    """
+    def __init__(self, address, events, baudrate=115200, speed=1.0):
+        self.address = address
+        self.baudrate = None         # débit du simulateur
+        self.next_baudrate = None
+        self.turnaround = 0.0005
+        self.commands = 0
+        self.replies = {}    # commande -> [(réponse, temps de traitement)]
+        for e in events:
+            temps = (e.end - e.start) - pyshell.wire_time(len(e.tx) + len(e.rx or b''), baudrate)
+            if speed:
+                temps /= speed
+            self.replies.setdefault(e.tx[6:-3].decode('ascii'), []).append((e.rx, max(0.0, temps)))
+        self.served = {}
+
+    def execute(self, commande):
+        self.commands += 1
+        enregistrees = self.replies.get(commande)
+        if not enregistrees:    # commande absente de la capture
+            self.turnaround = 0.0005
+            return SYNTAX_REPLY
+        k = self.served.get(commande, 0)
+        self.served[commande] = k + 1
+        reponse, self.turnaround = enregistrees[min(k, len(enregistrees) - 1)]
+        return reponse
+
+
+"""
+faux bus: un ReplayModule par adresse présente dans la capture
+(pseudo-terminal: Linux seulement, le rejeu vers un port réel n'en dépend pas)
+"""
+def replay_simulator(events, baudrate=115200, speed=1.0, timing=True):
+    import bmac_sim
+    adresses = {}
+    for e in events:
+        if e.address != None:
+            adresses.setdefault(e.address, []).append(e)
+    modules = [ReplayModule(a, ev, baudrate, speed) for a, ev in adresses.items()]
+    return bmac_sim.Simulator(modules, baudrate, timing=timing)
+
+
+"""
+regroupement des échanges enregistrés en flux continu (envoi d'une trame avant
+la réponse à la précédente, comme send_many), pour les rejouer de la même façon
+"""
+def batches(events):
+    lots = []
+    for e in events:
+        if lots and e.start < lots[-1][-1].end:
+            lots[-1].append(e)
+        else:
+            lots.append([e])
+    return lots
+
+
+"""
+envoi des trames de la capture sur le port au rythme enregistré divisé par speed
+(speed=0: à la suite, sans attente); renvoie [(événement d'origine, réponse, durée)]
+"""
+def replay(events, port, baudrate=115200, speed=1.0):
+    bus = pyshell.Bus.open(port, baudrate)
+    resultats = []
+    try:
+        t0 = time.monotonic()
+        for lot in batches(events):
+            if speed:
+                retard = t0 + (lot[0].start - events[0].start) / speed - time.monotonic()
+                if retard > 0:
+                    time.sleep(retard)
+            t = bus.transact([e.tx for e in lot], window=len(lot), timeout=None)
+            reponses = t.reponses + [(None, 0.0)] * (len(lot) - len(t.reponses))
+            resultats += [(e, r, d) for e, (r, d) in zip(lot, reponses)]
+    finally:
+        bus.close()
+    return resultats
+
+
+"""
+comparaison des latences et des réponses enregistrées et rejouées
+"""
+def report(resultats):
+    enregistrees = sorted(e.end - e.start for e, r, d in resultats)
+    rejouees = sorted(d for e, r, d in resultats)
+    differences = sum(r != e.rx for e, r, d in resultats)
+    for nom, valeurs in (('recorded', enregistrees), ('replayed', rejouees)):
+        print(f"{nom:>9}: p50 {percentile(valeurs, 50) * 1000:7.3f} ms  p95 {percentile(valeurs, 95) * 1000:7.3f} ms  "
+              f"p99 {percentile(valeurs, 99) * 1000:7.3f} ms  max {(valeurs[-1] if valeurs else 0) * 1000:7.3f} ms")
+    print(f"{len(resultats)} exchanges, {differences} replies differ from the capture")
+    return differences
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="rejeu d'une capture pyshell")
+    parser.add_argument("capture")
+    parser.add_argument("--port", help="port série réel (par défaut: module simulé à partir de la capture)")
+    parser.add_argument("--baudrate", type=int, default=115200)
+    parser.add_argument("--speed", type=float, default=1.0, help="facteur d'accélération (0: sans attente)")
+    parser.add_argument("--no-timing", action="store_true", help="module simulé sans temps de ligne ni de traitement")
+    parser.add_argument("--serve", action="store_true", help="faux module seul, jusqu'à Ctrl-C")
+    args = parser.parse_args()
+
+    logging.basicConfig(level=logging.ERROR)
+
+    events = list(pyshell.read_capture(args.capture))
+    if not events:
+        print(f"{args.capture}: empty capture")
+        sys.exit(1)
+
+    if args.port:
+        sys.exit(1 if report(replay(events, args.port, args.baudrate, args.speed)) else 0)
+
+    with replay_simulator(events, args.baudrate, args.speed, not args.no_timing) as sim:
+        if args.serve:
+            print(f"replaying {args.capture} on {sim.port} ({args.baudrate} bauds)")
+            try:
+                while True:
+                    time.sleep(1)
+            except KeyboardInterrupt:
+                pass
+        else:
+            sys.exit(1 if report(replay(events, sim.port, args.baudrate, args.speed)) else 0)
@@ -0,0 +1,266 @@
+#!/usr/bin/env python
+# -*- coding:utf-8 -*-
+
+""" -----------------------------------------
+	Simulateur de modules DMAC/BMAC
+	répond aux trames de pyshell.BMAC sur un pseudo-terminal (Linux)
+	-----------------------------------------
+"""
+
+# utilisation:
+#   python bmac_sim.py --address 0 1 2 --baudrate 115200
+#   puis BMAC(portCOM="/dev/pts/N", address=1) avec le port affiché au démarrage
+
+import logging
+import os
+import re
+import select
+import termios
+import threading
+import time
+import tty
+
+STX = 0x02
+ETX = 0x03
+
+
+"""
+construction d'une réponse avec données
+[ACK][XON][STX][SIZ1][SIZ2][SIZ3][DATA1]...[DATAn][CHK1][CHK2][ETX][EOL]
+"""
+def encode_reply(payload):
+    data = bytes(str(payload), 'ascii')
+    checksum = sum(data) % 256
+    return b'\x06\x1a\x02' + b'%03d' % len(data) + data + b'%02X' % checksum + b'\x03\n'
+
+
+ACK_REPLY = b'\x06'
+SYNTAX_REPLY = b'\x06\x18'
+
+BAUDRATES = [9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600]
+
+# correspondance des constantes termios avec les débits, pour connaître le débit du PC
+TERMIOS_SPEEDS = {getattr(termios, f"B{b}"): b for b in BAUDRATES if hasattr(termios, f"B{b}")}
+
+
+class Module:
+    """
+    module simulé: une table de registres et l'interprétation des commandes
+    READ <reg> (réponse avec la valeur) et WRITE <reg> <valeur> / <reg>=<valeur>
+    (acquittement seul); toute autre commande provoque une erreur de syntaxe,
+    sauf si un traitement est déclaré dans handlers (préfixe -> fonction(module, commande)).
+    READ #BAUDRATES donne les débits acceptés et WRITE #BAUDRATE <débit> fait passer
+    le module au nouveau débit après son acquittement
+    """
+    READ = re.compile(r'READ\s+(\S+)$')
+    WRITE = re.compile(r'(?:WRITE\s+)?(#?\w+)\s*[= ]\s*(\S+)$')
+
+    def __init__(self, address, registers=None, turnaround=0.0005, handlers=None, baudrates=BAUDRATES):
+        self.address = address
+        self.registers = {'#STATUS': 0, '#IDENT': f"BMAC-SIM {address:02}",
+                          '#BAUDRATES': " ".join(str(b) for b in baudrates)}
+        self.registers.update({k.upper(): v for k, v in (registers or {}).items()})
+        self.turnaround = turnaround    # temps de traitement d'une commande par le module (s)
+        self.handlers = {'WRITE #BAUDRATE ': Module.set_baudrate}
+        self.handlers.update(handlers or {})
+        self.baudrates = baudrates
+        self.baudrate = None            # débit du module (celui du simulateur par défaut)
+        self.next_baudrate = None       # débit appliqué après la réponse en cours
+        self.commands = 0
+
+    def set_baudrate(self, commande):
+        try:
+            baudrate = int(commande.split()[-1])
+        except ValueError:
+            return SYNTAX_REPLY
+        if baudrate not in self.baudrates:
+            return SYNTAX_REPLY
+        self.next_baudrate = baudrate
+        return ACK_REPLY
+
+    """
+    exécution d'une commande; renvoie les octets de la réponse (None: pas de réponse)
+    """
+    def execute(self, commande):
+        self.commands += 1
+        for prefixe, fn in self.handlers.items():
+            if commande.startswith(prefixe):
+                return fn(self, commande)
+        m = self.READ.match(commande)
+        if m:
+            if m.group(1) not in self.registers:
+                return SYNTAX_REPLY
+            return encode_reply(self.registers[m.group(1)])
+        m = self.WRITE.match(commande)
+        if m:
+            self.registers[m.group(1)] = m.group(2)
+            return ACK_REPLY
+        return SYNTAX_REPLY
+
+
+class Simulator:
+    """
+    bus simulé: un ou plusieurs modules derrière un pseudo-terminal dont le nom
+    (self.port) s'ouvre comme un port série avec BMAC(portCOM=...).
+    la durée de transmission des trames est respectée (10 bits par octet au débit
+    self.baudrate) ainsi que le temps de traitement de chaque module.
+    par défaut émission et réception sont indépendantes (liaison full-duplex);
+    avec half_duplex=True elles se partagent la ligne comme en RS-485 2 fils
+    """
+    def __init__(self, modules=None, baudrate=115200, timing=True, half_duplex=False):
+        if modules == None:
+            modules = [Module(0)]
+        self.modules = {m.address: m for m in modules}
+        self.baudrate = baudrate
+        for m in modules:
+            if m.baudrate == None:
+                m.baudrate = baudrate
+        self.timing = timing    # False: réponses immédiates, sans simuler la ligne
+        self.half_duplex = half_duplex
+        self.master, self.slave = os.openpty()
+        tty.setraw(self.master)
+        tty.setraw(self.slave)
+        self.port = os.ttyname(self.slave)
+        self.rx_bytes = 0
+        self.tx_bytes = 0
+        self.bad_frames = 0
+        self._rx_free = 0.0    # fin de réception de la dernière trame reçue
+        self._tx_free = 0.0    # fin d'émission de la dernière réponse
+        self._thread = None
+        self._running = False
+
+    def __enter__(self):
+        self.start()
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def start(self):
+        self._running = True
+        self._thread = threading.Thread(target=self._run, name="bmac_sim", daemon=True)
+        self._thread.start()
+
+    def close(self):
+        self._running = False
+        if self._thread != None:
+            self._thread.join()
+            self._thread = None
+        os.close(self.master)
+        os.close(self.slave)
+
+    """
+    durée de transmission de n octets sur la ligne (1 start, 8 data, 1 stop)
+    """
+    def wire_time(self, n):
+        return n * 10 / self.baudrate
+
+    def _wait_until(self, instant):
+        if self.timing:
+            retard = instant - time.monotonic()
+            if retard > 0:
+                time.sleep(retard)
+
+    def _run(self):
+        buf = bytearray()
+        while self._running:
+            r, _, _ = select.select([self.master], [], [], 0.05)
+            if not r:
+                continue
+            try:
+                data = os.read(self.master, 4096)
+            except OSError:
+                break
+            self._rx_free = max(self._rx_free, time.monotonic())
+            if self.half_duplex:
+                self._rx_free = max(self._rx_free, self._tx_free)
+            self.rx_bytes += len(data)
+            buf += data
+            for trame in self._frames(buf):
+                self._rx_free += self.wire_time(len(trame))    # instant de réception du dernier octet
+                self._handle(trame)
+
+    """
+    extraction des trames complètes [STX][SIZ1..3][ADR1][ADR2][CMD...][CHK1][CHK2][ETX]
+    """
+    def _frames(self, buf):
+        trames = []
+        while True:
+            i = buf.find(STX)
+            if i == -1:
+                buf.clear()
+                return trames
+            del buf[:i]
+            if len(buf) < 4:
+                return trames
+            try:
+                n = 1 + 3 + int(buf[1:4]) + 2 + 1
+            except ValueError:
+                self.bad_frames += 1
+                del buf[:1]
+                continue
+            if len(buf) < n:
+                return trames
+            trames.append(bytes(buf[:n]))
+            del buf[:n]
+
+    def _handle(self, trame):
+        contenu = trame[4:-3]
+        if trame[-1] != ETX or b'%02X' % (sum(contenu) % 256) != trame[-3:-1]:
+            self.bad_frames += 1    # checksum ou fin de trame incorrecte: le module ne répond pas
+            return
+        try:
+            address = int(contenu[:2])
+        except ValueError:
+            self.bad_frames += 1
+            return
+        module = self.modules.get(address)
+        if module == None:    # aucun module à cette adresse sur la ligne
+            return
+        if self._host_baudrate() not in (None, module.baudrate):    # trame illisible pour le module
+            self.bad_frames += 1
+            return
+        reponse = module.execute(contenu[2:].decode('ascii'))
+        if not reponse:
+            return
+        debut = max(self._rx_free + module.turnaround, self._tx_free)
+        self._tx_free = debut + self.wire_time(len(reponse))
+        if self.half_duplex:
+            self._rx_free = self._tx_free
+        self._wait_until(self._tx_free)
+        os.write(self.master, reponse)
+        self.tx_bytes += len(reponse)
+        if module.next_baudrate != None:
+            module.baudrate = self.baudrate = module.next_baudrate
+            module.next_baudrate = None
+
+    """
+    débit configuré par le PC sur le pseudo-terminal (None si inconnu)
+    """
+    def _host_baudrate(self):
+        return TERMIOS_SPEEDS.get(termios.tcgetattr(self.slave)[5])
+
+
+"""
+lancement du simulateur en ligne de commande
+"""
+if __name__ == '__main__':
+    import argparse
+
+    parser = argparse.ArgumentParser(description="simulateur de modules DMAC/BMAC sur pseudo-terminal")
+    parser.add_argument("--address", type=int, nargs="+", default=[0], help="adresses des modules simulés")
+    parser.add_argument("--baudrate", type=int, default=115200)
+    parser.add_argument("--turnaround", type=float, default=0.5, help="temps de traitement d'un module (ms)")
+    parser.add_argument("--no-timing", action="store_true", help="réponses immédiates")
+    args = parser.parse_args()
+
+    logging.basicConfig(level=logging.INFO)
+
+    modules = [Module(a, turnaround=args.turnaround / 1000) for a in args.address]
+    with Simulator(modules, args.baudrate, timing=not args.no_timing) as sim:
+        print(f"simulated modules {args.address} on {sim.port} ({args.baudrate} bauds)")
+        try:
+            while True:
+                time.sleep(1)
+        except KeyboardInterrupt:
+            pass
@@ -19,20 +19,1241 @@ __version__ = "5.1"
 
 import serial # https://github.com/pyserial/pyserial/
 import serial.tools.list_ports
+try:
+    import numpy # optionnel, pour ArrayReader
+except ImportError:
+    numpy = None
+try:
+    import fcntl # Linux, pour le réglage des adaptateurs FTDI (voir Bus.tune_ftdi)
+    import termios
+except ImportError:
+    fcntl = termios = None
+import asyncio
+import functools
+import json
 import logging
+import math
+import os
+import queue
+import re
+import select
+import struct
+import threading
+import time
+from array import array
+from collections import namedtuple
+from concurrent.futures import Future, ThreadPoolExecutor
+
+STX = '\x02'
+ETX = '\x03'
+ACK = 0x06
+XOFF = 0x18
+XON = 0x1a
+
+ASYNC_LOW_LATENCY = 0x2000    # drapeau de serial_struct (linux/tty_flags.h)
+
+# Réponse du module:
+# [ACK]                                                   commande acquittée sans réponse
+# [ACK][XOFF]                                             erreur de syntaxe
+# [ACK][XON][STX][SIZ1][SIZ2][SIZ3][DATA1]...[DATAn][CHK1][CHK2][ETX][EOL]
+REPLY_HEADER = 6    # ACK, XON, STX, SIZ1..3
+REPLY_TRAILER = 4   # CHK1, CHK2, ETX, fin de ligne
+
+
+class FrameParser:
+    """
+    analyseur incrémental des réponses du module: on lui fournit les octets
+    au fur et à mesure de leur arrivée, il extrait les trames complètes
+    """
+    def __init__(self):
+        self.buf = bytearray()
+        self.frames = []
+        self.garbage = 0    # nombre d'octets ignorés avant un ACK
+
+    def feed(self, data):
+        self.buf += data
+        while self.buf:
+            i = self.buf.find(ACK)
+            if i == -1:    # aucun début de trame: tout est à jeter
+                self.garbage += len(self.buf)
+                self.buf.clear()
+                break
+            if i > 0:
+                self.garbage += i
+                del self.buf[:i]
+            if len(self.buf) < 2:    # ACK seul: on ne sait pas encore si des données suivent
+                break
+            if self.buf[1] == XOFF:
+                n = 2
+            elif self.buf[1] != XON:    # l'octet suivant n'appartient pas à cette trame
+                n = 1
+            elif len(self.buf) < REPLY_HEADER:
+                break
+            else:
+                try:
+                    n = REPLY_HEADER + int(self.buf[3:6]) + REPLY_TRAILER
+                except ValueError:    # champ SIZ illisible: on resynchronise sur l'ACK suivant
+                    self.garbage += 1
+                    del self.buf[:1]
+                    continue
+                if len(self.buf) < n:
+                    break
+            self.frames.append(bytes(self.buf[:n]))
+            del self.buf[:n]
+        return self.frames
+
+    """
+    nombre d'octets dont on est certain qu'ils restent à lire pour terminer la trame en cours
+    """
+    def needed(self):
+        if len(self.buf) < 2:
+            return 1
+        if len(self.buf) < REPLY_HEADER:
+            return REPLY_HEADER - len(self.buf)
+        return REPLY_HEADER + int(self.buf[3:6]) + REPLY_TRAILER - len(self.buf)
+
+    """
+    vrai si seul un ACK est en attente: la trame est complète si plus rien n'arrive
+    """
+    def pending_ack(self):
+        return len(self.buf) == 1
+
+    """
+    termine la trame en cours après un silence de la ligne
+    """
+    def flush(self):
+        if self.pending_ack():
+            self.frames.append(bytes(self.buf))
+        self.buf.clear()
+        return self.frames
+
+    def pop(self):
+        return self.frames.pop(0) if self.frames else None
+
+# résultat d'une commande de send_many: réponse au format de BMAC.send et durée de l'échange (s)
+Reply = namedtuple('Reply', ['command', 'reply', 'elapsed'])
+
+# événement de trace d'un échange sur le bus (voir Bus.subscribe):
+# port, adresse du module, trame envoyée, réponse brute (None sur erreur série),
+# instants d'envoi et de fin de réception (time.monotonic), résultat
+# ("OK", "DATA", "COM ERROR", "SYNTAX ERROR" ou "SERIAL EXCEPTION"),
+# mêmes instants en nanosecondes entières (time.monotonic_ns)
+TraceEvent = namedtuple('TraceEvent', ['port', 'address', 'tx', 'rx', 'start', 'end', 'outcome', 'start_ns', 'end_ns'])
+
+
+"""
+somme de contrôle: somme des octets modulo 256
+"""
+def py_checksum(data):
+    return sum(data) % 256
+
+
+"""
+construction d'une trame de commande
+"""
+def py_encode_frame(lacommande, address=None):
+    lacommande = lacommande.upper() # conversion en majuscules
+    if address != None:
+        lacommande = f"{address:02}{lacommande}" # ajout des deux caractères d'adresse
+    checksum = sum(ord(c) for c in lacommande) % 256 # calcul de la checksum
+
+    # Protocole DMAC/BMAC:
+    # [STX][SIZ1][SIZ2][SIZ3][ADR1][ADR2][CMD1]...[CMDn][CHK1][CHK2][ETX]
+    # https://www.midi-ingenierie.com/documentation/ressources/notes_application/Syntaxe-et-communication-calculateur.pdf
+
+    lacommande_str = f"{STX}{len(lacommande):03}{lacommande}{checksum:02X}{ETX}"
+    return bytes(lacommande_str,'ascii')
+
+
+"""
+interprétation d'une réponse du module
+"""
+def py_decode_reply(reponse):
+    if reponse.find(b'\x06') == -1: # pas de STX: le module n'acquitte pas la réponse
+        return("COM ERROR")
+    elif reponse.find(b'\x18') != -1: # pas de XOFFerror: la commande n'a pas été correctement interprétée
+        return("SYNTAX ERROR")
+    elif reponse.find(b'\x1a') == -1: # pas de XON: il s'agit d'une commande, le module acquitte sans répondre
+        return("OK")
+    else:
+        return(reponse[6:-4].decode('ascii')) # décodage de la réponse (on ignore les caractères de 'protocole')
+
+
+"""
+résultat d'un échange, pour les événements de trace
+"""
+def py_reply_status(reponse):
+    if reponse == None:
+        return("SERIAL EXCEPTION")
+    elif reponse.find(b'\x06') == -1:
+        return("COM ERROR")
+    elif reponse.find(b'\x18') != -1:
+        return("SYNTAX ERROR")
+    elif reponse.find(b'\x1a') == -1:
+        return("OK")
+    else:
+        return("DATA")
+
+
+# accélérateur compilé optionnel (python setup.py build_ext --inplace), mêmes résultats
+try:
+    import _pyshell_accel
+    checksum = _pyshell_accel.checksum
+    _encode_frame = _pyshell_accel.encode_frame
+    decode_reply = _pyshell_accel.decode_reply
+    reply_status = _pyshell_accel.reply_status
+    ACCELERATED = True
+except ImportError:
+    checksum = py_checksum
+    _encode_frame = py_encode_frame
+    decode_reply = py_decode_reply
+    reply_status = py_reply_status
+    ACCELERATED = False
+
+"""
+durée de transmission de n octets à baudrate bauds (1 start, 8 data, 1 stop)
+"""
+def wire_time(n, baudrate):
+    return n * 10 / baudrate
+
+
+"""
+percentile (interpolation linéaire) d'une liste de valeurs triées
+"""
+def percentile(valeurs, p):
+    if not valeurs:
+        return 0.0
+    k = (len(valeurs) - 1) * p / 100
+    i = int(k)
+    if i + 1 >= len(valeurs):
+        return valeurs[-1]
+    return valeurs[i] + (valeurs[i + 1] - valeurs[i]) * (k - i)
+
+
+# les trames déjà construites sont conservées: les boucles de scrutation
+# renvoient sans cesse les mêmes commandes
+encode_frame = functools.lru_cache(maxsize=1024)(_encode_frame)
+
+
+"""
+classe de commande d'une trame: premier mot, suivi du registre s'il commence
+par # ("READ #STATUS", "WRITE #POS", "HOME"...)
+"""
+def command_class(trame):
+    texte = trame[4:-3].decode('ascii')
+    if texte[:2].isdigit():    # adresse du module
+        texte = texte[2:]
+    mots = texte.split()
+    if len(mots) > 1 and mots[1].startswith('#'):
+        return mots[0] + " " + mots[1].split('=')[0]
+    return mots[0].split('=')[0] if mots else ""    # #SPEED=300 -> #SPEED
+
+
+class TimeoutModel:
+    """
+    délai de réponse adaptatif par classe de commande (voir command_class).
+    le délai est la durée de transmission de la trame et de la réponse attendue
+    à ce débit, plus le temps de traitement du module estimé par une moyenne
+    glissante et son écart moyen (comme le RTO de TCP), borné par min_timeout
+    et max_timeout. tant que moins de min_samples réponses ont été observées,
+    default est utilisé. une réponse perdue double le délai de la classe (borné
+    par max_timeout), comme le recul du RTO de TCP, jusqu'à ce que min_samples
+    réponses permettent de nouveau de l'estimer. overrides fixe le délai
+    d'une classe ou d'une commande: {"HOME": 5.0}
+    """
+    def __init__(self, default=0.1, min_timeout=0.005, max_timeout=1.0, min_samples=8, overrides=None):
+        self.default = default
+        self.min_timeout = min_timeout
+        self.max_timeout = max_timeout
+        self.min_samples = min_samples
+        self.overrides = {k.upper(): v for k, v in (overrides or {}).items()}
+        self.stats = {}      # classe -> [moyenne, écart moyen, nombre de réponses, taille de réponse max, recul (0: aucun)]
+        self._classes = {}   # trame -> classe
+
+    def classify(self, trame):
+        classe = self._classes.get(trame)
+        if classe == None:
+            classe = command_class(trame)
+            if len(self._classes) > 4096:
+                self._classes.clear()
+            self._classes[trame] = classe
+        return classe
+
+    """
+    délai d'attente de la réponse à trame
+    """
+    def timeout(self, trame, baudrate):
+        classe = self.classify(trame)
+        if classe in self.overrides:
+            return self.overrides[classe]
+        if classe.split()[0] in self.overrides:
+            return self.overrides[classe.split()[0]]
+        st = self.stats.get(classe)
+        if st != None and st[4]:
+            return st[4]
+        if st == None or st[2] < self.min_samples:
+            return self.default
+        delai = wire_time(len(trame) + st[3], baudrate) + st[0] + 4 * st[1]
+        return min(self.max_timeout, max(self.min_timeout, delai))
+
+    """
+    prise en compte d'un échange: durée mesurée depuis l'envoi (réponse vide: perdue)
+    """
+    def observe(self, trame, reponse, duree, baudrate):
+        classe = self.classify(trame)
+        st = self.stats.get(classe)
+        if not reponse:
+            recul = min(self.max_timeout, 2 * self.timeout(trame, baudrate))
+            if st == None:
+                st = self.stats[classe] = [0.0, 0.0, 0, 0, 0.0]
+            st[4] = recul
+            return
+        traitement = max(0.0, duree - wire_time(len(trame) + len(reponse), baudrate))
+        if st == None or st[2] == 0:
+            self.stats[classe] = [traitement, traitement / 2, 1, len(reponse), st[4] if st != None else 0.0]
+            return
+        st[1] += (abs(traitement - st[0]) - st[1]) / 4
+        st[0] += (traitement - st[0]) / 8
+        st[2] += 1
+        st[3] = max(st[3], len(reponse))
+        if st[2] >= self.min_samples:
+            st[4] = 0.0    # estimation de nouveau possible
+
+
+class Command:
+    """
+    commande précompilée (BMAC.compile): la trame est construite une fois pour
+    toutes et l'envoi se réduit à l'écriture de ces octets
+    """
+    __slots__ = ('text', 'address', 'frame')
+
+    def __init__(self, text, address=None):
+        self.text = text
+        self.address = address
+        self.frame = encode_frame(text, address)
+
+    def __repr__(self):
+        return f"Command({self.text!r}, address={self.address})"
+
+
+class Registry:
+    """
+    description des registres des modules et du type de leur réponse, pour
+    BMAC.read(nom) qui renvoie directement une valeur typée. chargée depuis un
+    fichier JSON (Registry.load) de la forme:
+    {
+      "POS":    {"command": "READ #POS", "type": "float", "scale": 0.001},
+      "COUNT":  {"command": "READ #COUNT", "type": "int", "base": 16},
+      "STATUS": {"command": "READ #STATUS", "type": "bitfield", "bits": {"READY": 0, "FAULT": 1, "MODE": [4, 6]}},
+      "STATE":  {"command": "READ #STATE", "type": "enum", "values": {"0": "IDLE", "1": "RUN"}}
+    }
+    un décodeur est compilé une fois par registre et s'applique aux octets bruts
+    de la réponse; un bitfield donne un namedtuple (un bit: booléen, [premier, dernier]: entier)
+    """
+    def __init__(self, definitions):
+        self.entries = {}    # nom -> (commande, décodeur)
+        for nom, definition in definitions.items():
+            self.entries[nom.upper()] = (definition['command'], self.compile_decoder(nom, definition))
+
+    @classmethod
+    def load(cls, path):
+        with open(path) as f:
+            return cls(json.load(f))
+
+    def __getitem__(self, nom):
+        return self.entries[nom.upper()]
+
+    def __contains__(self, nom):
+        return nom.upper() in self.entries
+
+    @staticmethod
+    def compile_decoder(nom, definition):
+        genre = definition.get('type', 'str')
+        base = definition.get('base', 10)
+        if genre == 'int':
+            return lambda data: int(data, base)
+        if genre == 'float':
+            scale = definition.get('scale', 1.0)
+            if scale == 1.0:
+                return float
+            return lambda data: float(data) * scale
+        if genre == 'enum':
+            valeurs = {int(k): v for k, v in definition['values'].items()}
+            return lambda data: valeurs.get(int(data, base), int(data, base))
+        if genre == 'bitfield':
+            champs = []
+            for champ, bits in definition['bits'].items():
+                if isinstance(bits, int):
+                    champs.append((champ, bits, 1, True))
+                else:
+                    champs.append((champ, bits[0], (1 << (bits[1] - bits[0] + 1)) - 1, False))
+            Champs = namedtuple(re.sub(r'\W', '_', nom), [c[0] for c in champs])
+            def bitfield(data):
+                v = int(data, base)
+                return Champs(*[bool(v >> bit & 1) if booleen else v >> bit & masque
+                                for _, bit, masque, booleen in champs])
+            return bitfield
+        if genre == 'str':
+            return lambda data: data.decode('ascii')
+        raise ValueError(f"{nom}: unknown register type {genre}")
+
+
+class Transaction:
+    """
+    une ou plusieurs trames à échanger d'un bloc sur le bus
+    """
+    def __init__(self, trames, window=1, timeout=0.1):
+        self.trames = trames
+        self.window = window    # nombre maximal de trames envoyées sans réponse
+        self.timeout = timeout  # None: délai adaptatif du bus (TimeoutModel)
+        self.reponses = []      # (réponse brute, durée de l'échange) dans l'ordre des trames
+        self.error = None
+        self.t_envoi = []       # instants d'envoi des trames (time.monotonic)
+        self.t_envoi_ns = []    # mêmes instants en ns (time.monotonic_ns), pour la trace
+        self.attente = []       # (trame, durée pour TimeoutModel ou None, fin en ns) non encore publiées
+        self.future = Future()  # résolu avec la transaction elle-même une fois exécutée
+
+
+class Bus:
+    """
+    port série partagé par tous les modules d'une même ligne (RS-485 multipoint).
+    les transactions de tous les appelants passent par une file unique: le premier
+    thread qui obtient le bus exécute à la suite toutes les transactions en attente,
+    y compris celles des autres threads, si bien que la ligne ne reste pas inactive
+    entre deux appelants indépendants.
+    avec start(), un thread d'E/S dédié devient seul propriétaire du port et
+    les appelants reçoivent des futures (submit) au lieu d'attendre le bus
+    """
+    _buses = {}    # bus ouverts, par nom de port
+    _buses_lock = threading.Lock()
+
+    # commandes de changement de débit (syntaxe à adapter au firmware des modules)
+    BAUD_QUERY = "READ #BAUDRATES"      # réponse: débits acceptés séparés par des espaces ou des virgules
+    BAUD_SET = "WRITE #BAUDRATE {}"     # le module acquitte puis passe au nouveau débit
+    BAUD_VERIFY = "READ #STATUS"        # échange de vérification au nouveau débit
+    IDENT = "READ #IDENT"               # identification d'un module (voir discover)
+    PROBE = "READ #STATUS"              # sondage d'une adresse (voir scan)
+
+    def __init__(self, portCOM, baudrate=115200, silence=0.02):
+        self.portCOM = portCOM
+        self.baudrate = baudrate
+        self.silence = silence    # durée sans octet après un ACK seul pour considérer la réponse complète
+        self.ser = serial.Serial(port=portCOM,baudrate=baudrate,timeout=silence)
+        self.queue = queue.Queue()
+        self.lock = threading.Lock()
+        self.worker = None
+        self.subscribers = []
+        self.timeouts = TimeoutModel()
+        self.partial = 0    # réponses abandonnées incomplètes à l'échéance
+        self.garbage = 0    # octets reçus hors trame
+        self.resyncs = 0    # purges de l'entrée après une anomalie (voir resync)
+        self.addresses = set()    # adresses des modules ouverts sur ce bus (voir BMAC)
+        self.stale = False  # des octets d'un échange précédent peuvent encore arriver
+
+    """
+    bus partagé associé à un port (ouvert à la première demande)
+    """
+    @classmethod
+    def open(cls, portCOM, baudrate=115200, silence=0.02):
+        with cls._buses_lock:
+            bus = cls._buses.get(portCOM)
+            if bus is None:
+                bus = cls._buses[portCOM] = cls(portCOM, baudrate, silence)
+            elif bus.baudrate != baudrate:
+                logging.warning(f"{portCOM} already open at {bus.baudrate} bauds")
+            return bus
+
+    """
+    exécution d'une transaction; rend la main quand ses réponses sont disponibles
+    """
+    def transact(self, trames, window=1, timeout=0.1):
+        t = Transaction(trames, window, timeout)
+        self.queue.put(t)
+        if self.worker != None:
+            return t.future.result()
+        with self.lock:
+            if not t.future.done():    # sinon déjà exécutée par le thread qui détenait le bus
+                self._drain()
+        return t
+
+    """
+    mise en file d'une transaction pour le thread d'E/S (démarré si besoin),
+    renvoie la transaction, dont t.future est résolu après exécution
+    """
+    def submit(self, trames, window=1, timeout=0.1):
+        if self.worker == None:
+            self.start()
+        t = Transaction(trames, window, timeout)
+        self.queue.put(t)
+        return t
+
+    """
+    démarrage du thread d'E/S propriétaire du port
+    """
+    def start(self):
+        with self.lock:
+            if self.worker == None:
+                self.worker = threading.Thread(target=self._run, name=f"bus {self.portCOM}", daemon=True)
+                self.worker.start()
+
+    """
+    arrêt du thread d'E/S; les transactions restantes sont exécutées par l'appelant
+    """
+    def stop(self):
+        worker = self.worker
+        if worker == None:
+            return
+        self.queue.put(None)
+        worker.join()
+        with self.lock:
+            self.worker = None
+            self._drain()
+
+    def _run(self):
+        while True:
+            t = self.queue.get()
+            if t == None:
+                return
+            with self.lock:
+                self._complete(t)
+                self._drain()
+
+    """
+    exécution à la suite de toutes les transactions en file (bus verrouillé)
+    """
+    def _drain(self):
+        while True:
+            try:
+                t = self.queue.get_nowait()
+            except queue.Empty:
+                return
+            if t == None:    # arrêt du thread d'E/S demandé
+                self.queue.put(None)
+                return
+            self._complete(t)
+
+    def _complete(self, t):
+        try:
+            self._execute(t)
+        except serial.SerialException as e:
+            t.error = e
+            self.stale = True
+            self._publish(t)
+            if self.subscribers:
+                maintenant_ns = time.monotonic_ns()
+                for k in range(len(t.reponses), len(t.trames)):
+                    self._emit(t.trames[k], None, t.t_envoi_ns[k] or maintenant_ns, maintenant_ns)
+        t.future.set_result(t)
+
+    def _execute(self, t):
+        t_envoi = t.t_envoi = [0.0] * len(t.trames)
+        t_envoi_ns = t.t_envoi_ns = [0] * len(t.trames)
+        if self.stale:
+            self.resync()
+        parser = FrameParser()
+        envoyees = 0
+        debut = 0    # première trame envoyée depuis que toutes les réponses sont arrivées
+        t_reponse = 0.0
+        delais = [t.timeout] * len(t.trames)    # None: délai adaptatif (self.timeouts)
+        while len(t.reponses) < len(t.trames):
+            if envoyees < len(t.trames) and envoyees - len(t.reponses) < t.window:
+                fin = min(len(t.trames), len(t.reponses) + t.window)
+                self.ser.write(b''.join(t.trames[envoyees:fin]))    # envoi sur le port série
+                maintenant_ns = time.monotonic_ns()
+                maintenant = maintenant_ns / 1e9    # même horloge que time.monotonic
+                for k in range(envoyees, fin):
+                    t_envoi[k] = maintenant
+                    t_envoi_ns[k] = maintenant_ns
+                envoyees = fin
+            # échéance de la plus ancienne trame sans réponse, comptée à partir de la
+            # réponse précédente (les trames en file attendent leur tour sur la ligne)
+            k = len(t.reponses)
+            if delais[k] == None:
+                delais[k] = self.timeouts.timeout(t.trames[k], self.baudrate)
+            if self._read_step(parser, max(t_envoi[k], t_reponse) + delais[k]):
+                maintenant_ns = time.monotonic_ns()
+                maintenant = maintenant_ns / 1e9
+                while parser.frames and len(t.reponses) < envoyees:
+                    k = len(t.reponses)
+                    reponse = parser.pop()
+                    t.reponses.append((reponse, maintenant - t_envoi[k]))
+                    # une réponse perdue à délai imposé (scan) n'apprend rien au modèle de délai
+                    duree = maintenant - max(t_envoi[k], t_reponse) if reponse or t.timeout == None else None
+                    t.attente.append((k, duree, maintenant_ns))
+                    if not reponse and envoyees > debut + 1:
+                        maintenant = self._abandon(t, parser, debut, envoyees)
+                        break
+                if len(t.reponses) == envoyees:    # plus rien en route: les réponses sont sûres
+                    self._publish(t)
+                    debut = envoyees
+                t_reponse = maintenant
+        self._check(parser, t.reponses)
+
+    """
+    apprentissage des délais et événements de trace des réponses en attente (t.attente),
+    une fois leur attribution sûre
+    """
+    def _publish(self, t):
+        for k, duree, fin_ns in t.attente:
+            reponse = t.reponses[k][0]
+            if duree != None:
+                self.timeouts.observe(t.trames[k], reponse, duree, self.baudrate)
+            if self.subscribers:
+                self._emit(t.trames[k], reponse, t.t_envoi_ns[k], fin_ns)
+        t.attente = []
+
+    """
+    réponse perdue alors que d'autres trames étaient en route: les réponses ne
+    portant pas de numéro de commande, la perte a pu décaler toutes les réponses
+    reçues depuis la trame debut (la dernière fois que plus rien n'était en route).
+    ces trames et celles encore en route sont toutes comptées perdues, sans nourrir
+    TimeoutModel; les octets reçus ou encore en route sont écartés jusqu'au silence
+    de la ligne, puis les trames restantes sont envoyées. renvoie l'instant de reprise
+    """
+    def _abandon(self, t, parser, debut, envoyees):
+        maintenant_ns = time.monotonic_ns()
+        del t.reponses[debut:]
+        t.attente = []
+        for k in range(debut, envoyees):
+            t.reponses.append((b'', maintenant_ns / 1e9 - t.t_envoi[k]))
+            t.attente.append((k, None, maintenant_ns))
+        self.garbage += len(parser.buf) + sum(len(f) for f in parser.frames)
+        parser.buf.clear()
+        parser.frames.clear()
+        self.settle()
+        self.resyncs += 1
+        return time.monotonic()
+
+    """
+    lecture et rejet des octets reçus jusqu'à un silence de la ligne (bus verrouillé),
+    comptés dans garbage; renvoie faux si la ligne parle encore après limite secondes
+    """
+    def settle(self, limite=1.0):
+        fin = time.monotonic() + limite
+        while time.monotonic() < fin:
+            data = self._read(4096, self.silence)
+            if not data:
+                return True
+            self.garbage += len(data)
+        return False
+
+    """
+    abonnement aux événements de trace: fn(TraceEvent) est appelée pour chaque
+    échange (dans le thread qui détient le bus); sans abonné, rien n'est construit
+    """
+    def subscribe(self, fn):
+        self.subscribers = self.subscribers + [fn]
+
+    def unsubscribe(self, fn):
+        self.subscribers = [f for f in self.subscribers if f is not fn]
+
+    def _emit(self, trame, reponse, debut_ns, fin_ns):
+        try:
+            address = int(trame[4:6])
+        except ValueError:    # trame sans adresse
+            address = None
+        event = TraceEvent(self.portCOM, address, trame, reponse, debut_ns / 1e9, fin_ns / 1e9,
+                           reply_status(reponse), debut_ns, fin_ns)
+        for fn in self.subscribers:
+            try:
+                fn(event)
+            except Exception:
+                logging.exception("trace subscriber error")
+
+    """
+    lecture d'une réponse complète: on ne lit que les octets nécessaires
+    et on rend la main dès que la trame est terminée (sans attendre le timeout)
+    """
+    def read_reply(self, timeout=0.1):
+        deadline = time.monotonic() + timeout
+        parser = FrameParser()
+        while not self._read_step(parser, deadline):
+            pass
+        reponse = parser.pop()
+        self._check(parser, [(reponse, 0.0)])
+        return reponse
+
+    """
+    bilan d'un échange: octets hors trame, réponse perdue ou incomplète, ou octets
+    reçus en trop signalent une ligne désynchronisée, purgée avant l'échange suivant
+    """
+    def _check(self, parser, reponses):
+        self.garbage += parser.garbage
+        if parser.garbage or parser.buf or parser.frames or any(not r for r, d in reponses):
+            self.stale = True
+
+    """
+    resynchronisation après une anomalie: les octets déjà reçus (fin d'une réponse
+    tardive, parasites) sont lus et écartés, comptés dans garbage. l'entrée n'est
+    pas vidée à chaque échange: le chemin normal ne fait ni ioctl ni flush, et
+    les octets parasites isolés sont de toute façon sautés par FrameParser
+    jusqu'au prochain début de trame
+    """
+    def resync(self):
+        self.stale = False
+        self.resyncs += 1
+        n = self.ser.in_waiting
+        while n:
+            self.garbage += len(self.ser.read(n))
+            n = self.ser.in_waiting
+
+    """
+    une lecture sur le port série; renvoie vrai quand une trame est disponible dans parser
+    (une trame vide b'' signale une réponse perdue à l'échéance deadline)
+    """
+    def _read_step(self, parser, deadline):
+        data = self._read(parser.needed(), min(self.silence, deadline - time.monotonic()))
+        if data:
+            parser.feed(data)
+        elif parser.pending_ack() or time.monotonic() >= deadline:
+            if parser.buf and not parser.pending_ack():
+                self.partial += 1
+            parser.flush()
+            if not parser.frames:
+                parser.frames.append(b'')
+        return bool(parser.frames)
+
+    """
+    lecture d'au plus n octets; rend la main après attente secondes sans octet reçu.
+    sur un port POSIX l'attente est passée à select à chaque lecture (modifier
+    ser.timeout reconfigurerait le port); ailleurs ser.timeout n'est changé
+    qu'à l'approche de l'échéance
+    """
+    def _read(self, n, attente):
+        attente = max(0.0, attente)
+        fd = getattr(self.ser, 'fd', None)
+        if fd == None:
+            if self.ser.timeout != attente:
+                self.ser.timeout = attente
+            return self.ser.read(n)
+        try:
+            if not select.select([fd], [], [], attente)[0]:
+                return b''
+            data = os.read(fd, n)
+        except OSError as e:
+            raise serial.SerialException(f"read failed: {e}")
+        if not data:    # prêt en lecture mais sans donnée: port déconnecté
+            raise serial.SerialException("device reports readiness to read but returned no data")
+        return data
+
+    """
+    changement du débit du port (côté PC seulement)
+    """
+    def set_baudrate(self, baudrate):
+        with self.lock:
+            self.ser.baudrate = baudrate
+            self.baudrate = baudrate
+
+    """
+    passage de la ligne au débit le plus rapide accepté par tous les modules
+    addresses (les autres modules de la ligne ne suivraient pas):
+    chaque débit candidat, du plus rapide au plus lent, est demandé aux modules
+    puis vérifié par verify échanges; en cas d'échec les deux côtés reviennent
+    au débit de départ et le candidat suivant est essayé. rates remplace la liste
+    demandée aux modules. renvoie le débit retenu
+    """
+    def negotiate_baudrate(self, addresses, rates=None, max_baudrate=None, verify=3, timeout=0.1, settle=0.01):
+        initial = self.baudrate
+        if rates == None:
+            for a in addresses:
+                reponse = self._query(self.BAUD_QUERY, a, timeout)
+                try:
+                    supportes = {int(x) for x in re.split(r'[\s,;]+', reponse) if x}
+                except ValueError:    # erreur ou réponse inattendue: pas de changement possible
+                    supportes = set()
+                rates = supportes if rates == None else rates & supportes
+        candidats = sorted((r for r in rates if r > initial and (max_baudrate == None or r <= max_baudrate)), reverse=True)
+        for rate in candidats:
+            if self._try_baudrate(addresses, rate, initial, verify, timeout, settle):
+                logging.info(f"{self.portCOM}: baudrate {initial} -> {rate}")
+                return rate
+            logging.warning(f"{self.portCOM}: baudrate {rate} failed, back to {initial}")
+        return self.baudrate
+
+    def _try_baudrate(self, addresses, rate, initial, verify, timeout, settle):
+        erreurs = ("COM ERROR", "SYNTAX ERROR", "SERIAL EXCEPTION")
+        acquittes = 0
+        for a in addresses:
+            if self._query(self.BAUD_SET.format(rate), a, timeout) != "OK":
+                break
+            acquittes += 1
+        else:
+            self.set_baudrate(rate)
+            time.sleep(settle)    # le temps que les modules changent de débit
+            if all(self._query(self.BAUD_VERIFY, a, timeout) not in erreurs for a in addresses for i in range(verify)):
+                return True
+        if acquittes == 0:
+            return False
+        # retour au débit initial: demandé au nouveau débit aux modules qui l'ont accepté
+        self.set_baudrate(rate)
+        time.sleep(settle)
+        for a in addresses[:acquittes]:
+            self._query(self.BAUD_SET.format(initial), a, timeout)
+        self.set_baudrate(initial)
+        time.sleep(settle)
+        return False
+
+    """
+    recherche rapide des adresses actives de la ligne.
+    chaque adresse est d'abord sondée avec un délai serré: durée minimale de
+    l'échange à ce débit (trame de sondage + ACK) plus turnaround (traitement
+    du module) et latency (latence de l'adaptateur USB, 16 ms par défaut pour
+    un FTDI non réglé). sont ensuite revérifiées avec le délai normal timeout
+    les adresses qui ont répondu et celles dont la réponse était incomplète ou
+    brouillée. une réponse non confirmée venait d'un module trop lent pour le
+    délai serré: les adresses sondées dans les timeout secondes précédentes sont
+    alors revérifiées, de la plus proche à la plus ancienne, jusqu'à trouver ce
+    module. renvoie les adresses actives, triées.
+    durée pour 100 adresses à 115200 bauds (simulateur): 1,9 s avec latency=0.016,
+    0,4 s avec latency=0.001, valeur à réserver à un adaptateur réglé (tune_ftdi)
+    ou au overhead_ms mesuré par calibrate()
+    """
+    def scan(self, addresses=range(100), turnaround=0.001, latency=0.016, timeout=0.1):
+        addresses = list(addresses)
+        erreurs = ("COM ERROR", "SERIAL EXCEPTION")
+        delai = wire_time(len(encode_frame(self.PROBE, 0)) + 1, self.baudrate) + turnaround + latency
+        candidats = set()
+        douteux = set()
+        debuts = {}
+        for a in addresses:    # chaque lecture est bornée par l'échéance du sondage (voir _read)
+            anomalies = self.partial + self.garbage
+            debuts[a] = time.monotonic()
+            if self._query(self.PROBE, a, delai) not in erreurs:
+                candidats.add(a)
+            elif self.partial + self.garbage != anomalies:
+                douteux.add(a)
+        actives = set()
+        verifiees = set()
+        for a in sorted(candidats | douteux):
+            if a in verifiees:
+                continue
+            verifiees.add(a)
+            if self._query(self.PROBE, a, timeout) not in erreurs:
+                actives.add(a)
+            elif a in candidats:    # recherche du module lent à l'origine de la réponse
+                for b in reversed(addresses[:addresses.index(a)]):
+                    if debuts[b] < debuts[a] - timeout:
+                        break
+                    if b in verifiees:
+                        continue
+                    verifiees.add(b)
+                    if self._query(self.PROBE, b, timeout) not in erreurs:
+                        actives.add(b)
+                        break
+        return sorted(actives)
+
+    """
+    fichier sysfs du latency_timer de l'adaptateur FTDI (Linux), None pour un autre port
+    """
+    def ftdi_sysfs(self):
+        device = os.path.basename(os.path.realpath(self.portCOM))    # suit /dev/serial/by-id/...
+        if not any(os.path.basename(p.device) == device for p in serial.tools.list_ports.grep("0403:60")):
+            return None
+        chemin = f"/sys/bus/usb-serial/devices/{device}/latency_timer"
+        return chemin if os.path.exists(chemin) else None
+
+    """
+    réglages de l'adaptateur: {'ftdi', 'latency_timer' (ms), 'low_latency'};
+    None pour une valeur illisible ou sans objet
+    """
+    def ftdi_status(self):
+        chemin = self.ftdi_sysfs()
+        status = {'ftdi': chemin != None, 'latency_timer': None, 'low_latency': None}
+        if chemin != None:
+            try:
+                with open(chemin) as f:
+                    status['latency_timer'] = int(f.read())
+            except (OSError, ValueError):
+                pass
+        if fcntl != None and hasattr(termios, 'TIOCGSERIAL'):
+            serial_struct = array('i', [0] * 32)
+            try:
+                fcntl.ioctl(self.ser.fileno(), termios.TIOCGSERIAL, serial_struct)
+                status['low_latency'] = bool(serial_struct[4] & ASYNC_LOW_LATENCY)
+            except OSError:    # pseudo-terminal, pilote sans serial_struct
+                pass
+        return status
+
+    """
+    réglage de l'adaptateur FTDI sous Linux: latency_timer (ms, 16 par défaut,
+    l'écriture dans sysfs demande en général les droits root ou une règle udev)
+    et drapeau ASYNC_LOW_LATENCY du pilote. les réglages impossibles sont signalés
+    dans le log sans interrompre les autres; renvoie ftdi_status() après réglage
+    """
+    def tune_ftdi(self, latency_timer=1, low_latency=True):
+        chemin = self.ftdi_sysfs()
+        if chemin == None:
+            logging.warning(f"{self.portCOM}: not an FTDI adapter with a sysfs latency_timer")
+        elif latency_timer != None:
+            try:
+                with open(chemin, 'w') as f:
+                    f.write(str(latency_timer))
+            except OSError as e:
+                logging.error(f"{self.portCOM}: cannot set latency_timer: {e}")
+        if low_latency != None:
+            with self.lock:
+                try:
+                    self.ser.set_low_latency_mode(low_latency)
+                except (AttributeError, NotImplementedError, ValueError) as e:
+                    logging.error(f"{self.portCOM}: cannot set ASYNC_LOW_LATENCY: {e}")
+        return self.ftdi_status()
+
+    """
+    mesure de l'aller-retour réel avec le module address (n échanges de command):
+    renvoie {'min_ms', 'p50_ms', 'p95_ms', 'wire_ms', 'overhead_ms', 'lost', ...ftdi_status()}.
+    wire_ms est la durée minimale sur la ligne à ce débit et overhead_ms l'écart
+    médian restant (adaptateur USB, pilote, traitement du module): de l'ordre du
+    latency_timer quand celui-ci domine, à passer à scan(latency=...)
+    """
+    def calibrate(self, address, n=50, command=None, timeout=0.1):
+        command = command or self.PROBE
+        trame = encode_frame(command, address)
+        durees = []
+        perdues = 0
+        longueur = 0
+        for i in range(n):
+            t = self.transact([trame], timeout=timeout)
+            reponse, duree = t.reponses[0] if t.error == None else (b'', 0.0)
+            if reponse:
+                durees.append(duree)
+                longueur = len(reponse)
+            else:
+                perdues += 1
+        durees.sort()
+        wire = wire_time(len(trame) + longueur, self.baudrate)
+        mediane = durees[len(durees) // 2] if durees else math.nan
+        resultat = {
+            'min_ms': (durees[0] if durees else math.nan) * 1000,
+            'p50_ms': mediane * 1000,
+            'p95_ms': (durees[int(0.95 * (len(durees) - 1))] if durees else math.nan) * 1000,
+            'wire_ms': wire * 1000,
+            'overhead_ms': (mediane - wire) * 1000,
+            'lost': perdues,
+        }
+        resultat.update(self.ftdi_status())
+        return resultat
+
+    """
+    échange d'une commande avec le module address; renvoie la réponse décodée
+    """
+    def _query(self, lacommande, address, timeout=0.1):
+        t = self.transact([encode_frame(lacommande, address)], timeout=timeout)
+        if t.error != None:
+            return("SERIAL EXCEPTION")
+        return decode_reply(t.reponses[0][0])
+
+    """
+    fermeture du port
+    """
+    def close(self):
+        with Bus._buses_lock:
+            if Bus._buses.get(self.portCOM) is self:
+                del Bus._buses[self.portCOM]
+        self.stop()
+        self.ser.close()
+
+
+"""
+abonné de trace reproduisant les messages de log de BMAC.send
+"""
+def log_subscriber(event):
+    logging.info('checksum=' + str(int(event.tx[-3:-1], 16)))
+    logging.info('sending '+ str(len(event.tx)) + ' bytes :' + str(event.tx))
+    if event.rx != None:
+        logging.info('received ' + str(len(event.rx)) + ' bytes :' + str(event.rx))
+
+
+class Capture:
+    """
+    enregistrement des échanges du bus dans un fichier binaire (abonné de trace):
+        with Capture("terrain.bmcap") as cap:
+            my_bmac.subscribe(cap)
+    le fichier commence par MAGIC puis chaque échange est ajouté à la suite:
+    [début ns][fin ns][adresse][longueur trame][longueur réponse][trame][réponse]
+    (entiers little-endian, instants time.monotonic_ns, adresse -1 si absente,
+    longueur -1 si pas de réponse: erreur série). relecture avec read_capture
+    """
+    MAGIC = b'BMCAP1\n'
+    RECORD = struct.Struct('<qqhHi')
+
+    def __init__(self, path):
+        self.file = open(path, 'ab')
+        if self.file.tell() == 0:
+            self.file.write(self.MAGIC)
+        self.records = 0
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def __call__(self, event):
+        rx = event.rx if event.rx != None else b''
+        self.file.write(self.RECORD.pack(event.start_ns, event.end_ns,
+                                         -1 if event.address == None else event.address,
+                                         len(event.tx), -1 if event.rx == None else len(rx)) + event.tx + rx)
+        self.records += 1
+
+    def close(self):
+        self.file.close()
+
+
+"""
+relecture d'un fichier de Capture: générateur de TraceEvent (instants en s,
+port = nom du fichier); s'arrête proprement sur un dernier échange tronqué
+"""
+def read_capture(path):
+    with open(path, 'rb') as f:
+        if f.read(len(Capture.MAGIC)) != Capture.MAGIC:
+            raise ValueError(f"{path}: not a pyshell capture")
+        while True:
+            entete = f.read(Capture.RECORD.size)
+            if len(entete) < Capture.RECORD.size:
+                return
+            debut, fin, address, n_tx, n_rx = Capture.RECORD.unpack(entete)
+            tx = f.read(n_tx)
+            rx = f.read(n_rx) if n_rx >= 0 else None
+            if len(tx) < n_tx or (rx != None and len(rx) < n_rx):
+                return
+            yield TraceEvent(path, None if address < 0 else address, tx, rx,
+                             debut / 1e9, fin / 1e9, reply_status(rx), debut, fin)
+
+
+class Metrics:
+    """
+    statistiques des échanges (abonné de trace), par port, adresse et classe de
+    commande (voir command_class): histogramme des durées d'échange, nombre de
+    réponses par résultat ("OK", "DATA", "COM ERROR", "SYNTAX ERROR",
+    "SERIAL EXCEPTION"), réponses perdues (aucun octet reçu à l'échéance) et
+    octets émis/reçus. un même objet peut être abonné à plusieurs bus:
+        metrics = Metrics()
+        my_bmac.subscribe(metrics)
+        metrics.start(15, lambda m: m.write("/var/lib/node_exporter/pyshell.prom"))
+    le label command est la classe de commande, sans valeur écrite (#SPEED=300 -> #SPEED);
+    au-delà de max_commands classes distinctes, les suivantes sont comptées sous "OTHER"
+    pour borner le nombre de séries exportées
+    """
+    BUCKETS = (0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1.0)    # bornes des histogrammes (s)
+
+    def __init__(self, buckets=BUCKETS, max_commands=64):
+        self.buckets = tuple(buckets)
+        self.max_commands = max_commands
+        self.commands = set()    # classes de commande exportées
+        self.series = {}    # (port, adresse, classe) -> [compteurs par borne + inf, somme, nombre]
+        self.outcomes = {}  # (port, adresse, classe, résultat) -> nombre
+        self.lost = {}      # (port, adresse, classe) -> réponses perdues
+        self.tx_bytes = {}  # port -> octets émis
+        self.rx_bytes = {}  # port -> octets reçus
+        self.lock = threading.Lock()
+        self._stop = threading.Event()
+        self._thread = None
+
+    def __call__(self, event):
+        classe = command_class(event.tx)
+        duree = event.end - event.start
+        with self.lock:
+            if classe not in self.commands:
+                if len(self.commands) >= self.max_commands:
+                    classe = "OTHER"
+                else:
+                    self.commands.add(classe)
+            cle = (event.port, event.address, classe)
+            h = self.series.get(cle)
+            if h == None:
+                h = self.series[cle] = [0] * (len(self.buckets) + 1) + [0.0, 0]
+            i = 0
+            while i < len(self.buckets) and duree > self.buckets[i]:
+                i += 1
+            h[i] += 1
+            h[-2] += duree
+            h[-1] += 1
+            self.outcomes[cle + (event.outcome,)] = self.outcomes.get(cle + (event.outcome,), 0) + 1
+            if event.rx == b'':
+                self.lost[cle] = self.lost.get(cle, 0) + 1
+            self.tx_bytes[event.port] = self.tx_bytes.get(event.port, 0) + len(event.tx)
+            self.rx_bytes[event.port] = self.rx_bytes.get(event.port, 0) + len(event.rx or b'')
+
+    """
+    export au format texte de Prometheus (fichier du textfile collector de node_exporter)
+    """
+    def prometheus(self):
+        def labels(port, address, classe, **extra):
+            paires = [('port', port), ('address', '' if address == None else address), ('command', classe)]
+            paires += list(extra.items())
+            return "{" + ",".join(k + '="' + str(v).replace('\\', '\\\\').replace('"', '\\"') + '"'
+                                  for k, v in paires) + "}"
+        with self.lock:
+            lignes = ["# HELP pyshell_exchange_seconds duration of a command/reply exchange",
+                      "# TYPE pyshell_exchange_seconds histogram"]
+            for (port, address, classe), h in sorted(self.series.items(), key=str):
+                cumul = 0
+                for borne, n in zip(self.buckets + ('+Inf',), h):
+                    cumul += n
+                    lignes.append(f"pyshell_exchange_seconds_bucket{labels(port, address, classe, le=borne)} {cumul}")
+                lignes.append(f"pyshell_exchange_seconds_sum{labels(port, address, classe)} {h[-2]:.9f}")
+                lignes.append(f"pyshell_exchange_seconds_count{labels(port, address, classe)} {h[-1]}")
+            lignes += ["# HELP pyshell_replies_total exchanges by outcome",
+                       "# TYPE pyshell_replies_total counter"]
+            for (port, address, classe, resultat), n in sorted(self.outcomes.items(), key=str):
+                lignes.append(f"pyshell_replies_total{labels(port, address, classe, outcome=resultat)} {n}")
+            lignes += ["# HELP pyshell_timeouts_total replies not received before the deadline",
+                       "# TYPE pyshell_timeouts_total counter"]
+            for (port, address, classe), n in sorted(self.lost.items(), key=str):
+                lignes.append(f"pyshell_timeouts_total{labels(port, address, classe)} {n}")
+            for nom, compteurs in (('tx', self.tx_bytes), ('rx', self.rx_bytes)):
+                lignes += [f"# HELP pyshell_{nom}_bytes_total bytes {'sent' if nom == 'tx' else 'received'}",
+                           f"# TYPE pyshell_{nom}_bytes_total counter"]
+                for port, n in sorted(compteurs.items(), key=str):
+                    lignes.append(f'pyshell_{nom}_bytes_total{{port="{port}"}} {n}')
+        return "\n".join(lignes) + "\n"
+
+    """
+    écriture de l'export dans un fichier, remplacé d'un bloc (jamais lu à moitié écrit)
+    """
+    def write(self, path):
+        with open(path + ".tmp", 'w') as f:
+            f.write(self.prometheus())
+        os.replace(path + ".tmp", path)
+
+    """
+    appel périodique de fn(metrics) dans un thread, par exemple pour write ou
+    pour transmettre prometheus() à un autre système
+    """
+    def start(self, interval, fn):
+        self._stop.clear()
+        def boucle():
+            while not self._stop.wait(interval):
+                try:
+                    fn(self)
+                except Exception:
+                    logging.exception("metrics export error")
+        self._thread = threading.Thread(target=boucle, name="metrics", daemon=True)
+        self._thread.start()
+
+    def stop(self):
+        self._stop.set()
+        if self._thread != None:
+            self._thread.join()
+            self._thread = None
+
+
+class RetryPolicy:
+    """
+    reprise automatique des commandes dont la réponse est perdue ("COM ERROR"),
+    selon leur nature:
+    - lecture (READ ...): renvoyée telle quelle, sans effet sur le module
+    - écriture d'une valeur (WRITE #<reg> <valeur>, #<reg>=<valeur>): le registre
+      est d'abord relu; si la valeur est déjà en place l'écriture avait abouti et
+      n'est pas renvoyée, sinon elle est renvoyée. une relecture en erreur laisse
+      l'état du registre inconnu: la commande n'est alors pas renvoyée
+    - autre commande (HOME, MOVE 100...) ou classe listée dans unsafe: jamais renvoyée,
+      l'effet d'un second envoi n'étant pas connu
+    au plus retries reprises, espacées de backoff doublé à chaque fois (borné par
+    max_backoff); le délai de réponse reste celui du bus, qui après une perte
+    repasse au délai par défaut de TimeoutModel. les erreurs de syntaxe et les
+    erreurs du port série ne sont pas reprises.
+    compteurs: attempts (trames supplémentaires), recovered (réponse obtenue par
+    renvoi), verified (écriture confirmée par relecture), failed, et par classe
+    de commande counts[classe]
+    """
+    READ = re.compile(r'READ\s+(\S+)$', re.IGNORECASE)
+    WRITE = re.compile(r'(?:WRITE\s+(#\w+)\s*[= ]|(#\w+)\s*=)\s*(\S+)$', re.IGNORECASE)
+
+    def __init__(self, retries=2, backoff=0.002, max_backoff=0.05, unsafe=()):
+        self.retries = retries
+        self.backoff = backoff
+        self.max_backoff = max_backoff
+        self.unsafe = {c.upper() for c in unsafe}    # classes de commande à ne jamais renvoyer, ex. "WRITE #MOVE"
+        self.attempts = 0
+        self.recovered = 0
+        self.verified = 0
+        self.failed = 0
+        self.counts = {}    # classe de commande -> nombre de reprises
+
+    """
+    nature d'une commande: ('read', None, None), ('write', registre, valeur) ou ('unsafe', None, None)
+    """
+    def classify(self, texte):
+        texte = texte.upper().strip()
+        mots = texte.split()
+        if not mots:
+            return ('unsafe', None, None)
+        if mots[0] in self.unsafe or (len(mots) > 1 and mots[0] + " " + mots[1].split('=')[0] in self.unsafe):
+            return ('unsafe', None, None)
+        if self.READ.match(texte):
+            return ('read', None, None)
+        m = self.WRITE.match(texte)
+        if m:
+            return ('write', m.group(1) or m.group(2), m.group(3))
+        return ('unsafe', None, None)
+
+    @staticmethod
+    def _same(lu, valeur):
+        if lu.strip() == valeur:
+            return True
+        try:
+            return float(lu) == float(valeur)
+        except ValueError:
+            return False
+
+    """
+    reprise d'une commande dont la réponse a été perdue; renvoie la réponse finale au format de BMAC.send
+    """
+    def recover(self, bmac, lacommande):
+        texte = lacommande.text if isinstance(lacommande, Command) else lacommande
+        genre, registre, valeur = self.classify(texte)
+        if genre == 'unsafe':
+            self.failed += 1
+            return "COM ERROR"
+        classe = command_class(bmac._frame(lacommande))
+        for k in range(self.retries):
+            time.sleep(min(self.max_backoff, self.backoff * 2 ** k))
+            self.counts[classe] = self.counts.get(classe, 0) + 1
+            self.attempts += 1
+            if genre == 'write':
+                lu = bmac._send(f"READ {registre}")
+                if lu in ("COM ERROR", "SYNTAX ERROR", "SERIAL EXCEPTION"):    # état du registre inconnu
+                    break
+                if self._same(lu, valeur):
+                    self.verified += 1
+                    return "OK"
+                self.attempts += 1
+            reponse = bmac._send(lacommande)
+            if reponse != "COM ERROR":
+                self.recovered += 1
+                return reponse
+        self.failed += 1
+        return "COM ERROR"
+
 
 class BMAC:
 
-    STX = '\x02'
-    ETX = '\x03'
+    STX = STX
+    ETX = ETX
     
     """
     initialisation et config du port série
+    plusieurs instances (une par adresse) peuvent partager le même port: elles
+    utilisent alors le même Bus, éventuellement fourni par le paramètre bus
     """
-    def __init__(self, portCOM=None, baudrate=115200, address=0):
+    def __init__(self, portCOM=None, baudrate=115200, address=0, timeout=None, silence=0.02, bus=None, timeouts=None, registry=None, retry=None):
         self.portCOM = portCOM
+        self.bus = bus
         self.baudrate = baudrate
         self.address = address
+        self.timeout = timeout    # délai maximal d'attente d'une réponse (None: adaptatif, voir TimeoutModel)
+        self.silence = silence    # durée sans octet après un ACK seul pour considérer la réponse complète
+        self.registry = registry  # registres typés pour read (voir Registry)
+        self.retry = retry        # reprise des réponses perdues par send (voir RetryPolicy)
+        self._registres = {}      # nom -> (Command, décodeur)
+
+        if self.bus != None:
+            self.portCOM = bus.portCOM
+            self.ser = bus.ser
+            self.bus.addresses.add(address)
+            self.bus.timeouts.overrides.update({k.upper(): v for k, v in (timeouts or {}).items()})
+            return
         
         #recherche automatique du port COM FTDI si portCOM=None
         if self.portCOM == None:
@@ -40,59 +1261,979 @@ class BMAC:
             if len(liste)>0 :
                 logging.info("found FTDI serial port " + liste[0].device)
                 self.portCOM = liste[0].device
+                if len(liste)>1 :
+                    logging.warning("several FTDI serial ports found, using " + liste[0].device + " (see discover())")
             else:
                 logging.error("ERROR: No FTDI serial interface found")
 
         
         #instanciation du port série pyserial
         try:
-            self.ser = serial.Serial(port=self.portCOM,baudrate=self.baudrate,timeout=0.1)
+            self.bus = self._open_bus()
+            self.ser = self.bus.ser
+            self.bus.addresses.add(address)
+            # délais imposés par commande, par exemple {"HOME": 5.0}
+            self.bus.timeouts.overrides.update({k.upper(): v for k, v in (timeouts or {}).items()})
         except:
             logging.error(f"serial port error")
 
+    def _open_bus(self):
+        return Bus.open(self.portCOM, self.baudrate, self.silence)
+
+    """
+    débit de la ligne: celui du bus, commun à toutes les instances du port
+    """
+    @property
+    def baudrate(self):
+        return self.bus.baudrate if self.bus != None else self._baudrate
+
+    @baudrate.setter
+    def baudrate(self, baudrate):
+        self._baudrate = baudrate    # débit demandé à l'ouverture du port
+
+    """
+    abonnement aux événements de trace du bus (voir Bus.subscribe)
+    """
+    def subscribe(self, fn):
+        self.bus.subscribe(fn)
+
+    def unsubscribe(self, fn):
+        self.bus.unsubscribe(fn)
+
+    """
+    passage au débit le plus rapide accepté par tous les modules ouverts sur le
+    port (instances BMAC partageant le bus), avec retour automatique au débit
+    courant en cas d'échec (voir Bus.negotiate_baudrate); renvoie le débit retenu
+    """
+    def negotiate_baudrate(self, rates=None, max_baudrate=None, verify=3):
+        return self.bus.negotiate_baudrate(sorted(self.bus.addresses), rates, max_baudrate, verify, self.timeout)
+
+    """
+    réglage basse latence de l'adaptateur FTDI (voir Bus.tune_ftdi) puis mesure
+    de l'aller-retour obtenu avec le module (voir Bus.calibrate)
+    """
+    def tune_latency(self, latency_timer=1, low_latency=True, n=50):
+        self.bus.tune_ftdi(latency_timer, low_latency)
+        return self.calibrate(n)
+
+    def calibrate(self, n=50):
+        return self.bus.calibrate(self.address, n, timeout=self.timeout or 0.1)
+
+    """
+    précompilation d'une commande envoyée fréquemment: le résultat peut être passé
+    à send, submit et send_many à la place du texte de la commande
+    """
+    def compile(self, lacommande):
+        return Command(lacommande, self.address)
+
+    def _frame(self, lacommande):
+        if isinstance(lacommande, Command):
+            return lacommande.frame
+        return encode_frame(lacommande, self.address)
 
     """
     envoi d'une commande et gestion de la réponse du module
     """
     def send(self, lacommande):
-        self.ser.flushInput()    #réinitialise les buffers
-        self.ser.flushOutput()
-        lacommande = lacommande.upper() # conversion en majuscules
-        if self.address != None:
-            lacommande = f"{self.address:02}{lacommande}" # ajout des deux caractères d'adresse
-        checksum = sum(ord(c) for c in lacommande) % 256 # calcul de la checksum
-        logging.info('checksum=' + str(checksum))
-
-        # Protocole DMAC/BMAC:
-        # [STX][SIZ1][SIZ2][SIZ3][ADR1][ADR2][CMD1]...[CMDn][CHK1][CHK2][ETX]
-        # https://www.midi-ingenierie.com/documentation/ressources/notes_application/Syntaxe-et-communication-calculateur.pdf
-        
-        lacommande_str = f"{self.STX}{len(lacommande):03}{lacommande}{checksum % 256:02X}{self.ETX}"
-        lacommande_bytes = bytes(lacommande_str,'ascii')
-        logging.info('sending '+ str(len(lacommande_bytes)) + ' bytes :' + str(lacommande_bytes))
-        
+        reponse = self._send(lacommande)
+        if reponse == "COM ERROR" and self.retry != None:
+            return self.retry.recover(self, lacommande)
+        return reponse
+
+    def _send(self, lacommande):
+        lacommande_bytes = self._frame(lacommande)
+        t = self.bus.transact([lacommande_bytes], timeout=self.timeout)
+        return self._reply(t)
+
+    """
+    envoi d'une commande par le thread d'E/S du bus, sans attendre la réponse:
+    renvoie une Future résolue avec la même réponse que send
+    """
+    def submit(self, lacommande):
+        lacommande_bytes = self._frame(lacommande)
+        resultat = Future()
+        t = self.bus.submit([lacommande_bytes], timeout=self.timeout)
+        t.future.add_done_callback(lambda f: resultat.set_result(self._reply(t)))
+        return resultat
+
+    def _reply(self, t):
+        if t.error != None:
+            logging.error('serial error: ' + str(t.error))
+            return("SERIAL EXCEPTION")
+
+        return decode_reply(t.reponses[0][0])
+
+    """
+    lecture d'un registre décrit dans self.registry: renvoie la valeur typée,
+    ou comme send "OK", "COM ERROR", "SYNTAX ERROR", "SERIAL EXCEPTION"
+    (et le texte brut d'une réponse que le décodeur ne sait pas lire)
+    """
+    def read(self, nom):
+        return self.read_many([nom])[0]
+
+    """
+    lecture de plusieurs registres en flux continu (comme send_many)
+    """
+    def read_many(self, noms, window=8):
+        registres = [self._registre(nom) for nom in noms]
+        t = self.bus.transact([c.frame for c, _ in registres], window, self.timeout)
+        if t.error != None:
+            logging.error('serial error: ' + str(t.error))
+        valeurs = [self._valeur(decodeur, reponse) for (_, decodeur), (reponse, _) in zip(registres, t.reponses)]
+        return valeurs + ["SERIAL EXCEPTION"] * (len(registres) - len(valeurs))
+
+    """
+    valeur typée d'une réponse brute (statut si la réponse ne porte pas de données)
+    """
+    @staticmethod
+    def _valeur(decodeur, reponse):
+        statut = reply_status(reponse)
+        if statut != "DATA":
+            return statut
+        data = reponse[REPLY_HEADER:-REPLY_TRAILER]
         try:
-            self.ser.write(lacommande_bytes)    # envoi sur le port série
+            return decodeur(data)
+        except ValueError:
+            return data.decode('ascii', 'replace')
+
+    def _registre(self, nom):
+        registre = self._registres.get(nom)
+        if registre == None:
+            lacommande, decodeur = self.registry[nom]
+            registre = self._registres[nom] = (self.compile(lacommande), decodeur)
+        return registre
+
+    """
+    envoi d'une série de commandes en flux continu: jusqu'à window trames sont
+    envoyées sans attendre les réponses, qui sont relues dans l'ordre d'envoi.
+    renvoie une liste de Reply(command, reply, elapsed) dans l'ordre des commandes.
+    les réponses ne portant pas de numéro de commande, une réponse perdue rend
+    incertaines toutes celles reçues depuis la dernière fois que plus rien n'était
+    en route: ces commandes sont toutes rendues en "COM ERROR", leur effet sur le
+    module étant inconnu, puis la série reprend (voir Bus._abandon)
+    """
+    def send_many(self, commandes, window=8):
+        commandes = list(commandes)
+        trames = [self._frame(c) for c in commandes]    # préparation de toutes les trames
+        t = self.bus.transact(trames, window, self.timeout)
+        resultats = [Reply(c, decode_reply(r), dt) for c, (r, dt) in zip(commandes, t.reponses)]
+        if t.error != None:
+            logging.error('serial error: ' + str(t.error))
+            resultats += [Reply(c, "SERIAL EXCEPTION", 0.0) for c in commandes[len(resultats):]]
+        return resultats
+
+
+class AsyncPort:
+    """
+    transport asyncio d'un port série, partagé par toutes les instances AsyncBMAC
+    du port (un module par adresse sur la même ligne RS-485): un seul descripteur
+    et un seul verrou, donc une seule transaction à la fois sur la ligne.
+    la lecture est pilotée par la boucle d'événements (add_reader sur le descripteur);
+    le port est rattaché à la boucle qui l'utilise, et de nouveau si elle change
+    (asyncio.run successifs). Sur les plateformes sans add_reader (Windows/Proactor)
+    la lecture bloquante du Bus est déportée dans l'executor par défaut
+    """
+    _ports = {}    # ports ouverts, par nom de port
+    _ports_lock = threading.Lock()
+
+    def __init__(self, portCOM, baudrate=115200, silence=0.02):
+        self.bus = Bus(portCOM, baudrate, silence)    # privé: la boucle pilote seule le port
+        self.ser = self.bus.ser
+        self.silence = silence
+        self.users = 0    # instances AsyncBMAC ouvertes sur ce port
+        self.loop = None
+        self.lock = None
+        self.reader = False
+        self.parser = FrameParser()
+        self.waiter = None
+        self.silence_handle = None
+
+    """
+    transport associé à un port (ouvert à la première demande), à libérer par release()
+    """
+    @classmethod
+    def open(cls, portCOM, baudrate=115200, silence=0.02):
+        with cls._ports_lock:
+            port = cls._ports.get(portCOM)
+            if port is None:
+                port = cls._ports[portCOM] = cls(portCOM, baudrate, silence)
+            elif port.bus.baudrate != baudrate:
+                logging.warning(f"{portCOM} already open at {port.bus.baudrate} bauds")
+            port.users += 1
+            return port
+
+    """
+    fermeture du port quand sa dernière instance le libère
+    """
+    def release(self):
+        with AsyncPort._ports_lock:
+            self.users -= 1
+            if self.users > 0:
+                return
+            if AsyncPort._ports.get(self.bus.portCOM) is self:
+                del AsyncPort._ports[self.bus.portCOM]
+        self._detach()
+        self.bus.close()
+
+    """
+    rattachement du port à la boucle en cours d'exécution
+    """
+    def attach(self):
+        loop = asyncio.get_running_loop()
+        if loop is self.loop:
+            return
+        self._detach()
+        self.loop = loop
+        self.lock = asyncio.Lock()
+        try:
+            loop.add_reader(self.ser.fileno(), self._on_readable)
+            self.ser.timeout = 0    # lectures non bloquantes, déclenchées par la boucle
+            self.reader = True
+        except (NotImplementedError, AttributeError, ValueError):
+            self.ser.timeout = self.silence
+            self.reader = False
+
+    def _detach(self):
+        if self.reader:
+            try:
+                self.loop.remove_reader(self.ser.fileno())
+            except (RuntimeError, AttributeError, ValueError):    # boucle déjà fermée
+                pass
+            self.reader = False
+
+    def _on_readable(self):
+        try:
+            data = self.ser.read(4096)
         except serial.SerialException as e:
-            logging.error('serial error: ' + e)
-            return("SERIAL EXCEPTION")
-            
-        try:    
-            reponse = self.ser.readline()       # relecture de la réponse
-            logging.info('received ' + str(len(reponse)) + ' bytes :' + str(reponse))
+            if self.waiter is not None and not self.waiter.done():
+                self.waiter.set_exception(e)
+            return
+        if self.waiter is None:    # octets hors transaction: ignorés
+            return
+        if self.silence_handle is not None:
+            self.silence_handle.cancel()
+            self.silence_handle = None
+        self.parser.feed(data)
+        if self.parser.frames:
+            if not self.waiter.done():
+                self.waiter.set_result(self.parser.pop())
+        elif self.parser.pending_ack():
+            self.silence_handle = self.loop.call_later(self.silence, self._on_silence)
+
+    def _on_silence(self):
+        self.silence_handle = None
+        self.parser.flush()
+        if self.parser.frames and self.waiter is not None and not self.waiter.done():
+            self.waiter.set_result(self.parser.pop())
+
+    """
+    échange d'une trame, une seule transaction à la fois sur le port;
+    renvoie (réponse brute, b'' si perdue, instant d'envoi en ns)
+    """
+    async def exchange(self, trame, timeout):
+        self.attach()
+        async with self.lock:
+            debut = time.monotonic_ns()
+            try:
+                if self.bus.stale:
+                    self.bus.resync()
+                self.parser = FrameParser()
+                self.waiter = self.loop.create_future()
+                self.ser.write(trame)
+                if self.reader:
+                    return await asyncio.wait_for(self.waiter, timeout), debut
+                return await self.loop.run_in_executor(None, self.bus.read_reply, timeout), debut
+            except asyncio.TimeoutError:
+                self.bus.stale = True
+                return b'', debut
+            except serial.SerialException:
+                self.bus.stale = True
+                raise
+            finally:
+                self.waiter = None
+                if self.silence_handle is not None:
+                    self.silence_handle.cancel()
+                    self.silence_handle = None
+
+
+class AsyncBMAC(BMAC):
+    """
+    client asyncio: même trame et même décodage que BMAC.send, mais la lecture est
+    pilotée par la boucle d'événements, une seule boucle peut donc dialoguer avec
+    de nombreux ports et modules sans thread dédié. les instances d'un même port
+    partagent son AsyncPort; le port n'est pas partagé avec les instances BMAC.
+    send, send_many, read et read_many sont des coroutines; les méthodes bloquantes
+    de BMAC (submit, negotiate_baudrate, calibrate...) contourneraient le verrou
+    de l'AsyncPort et lèvent NotImplementedError
+    """
+    def _open_bus(self):
+        self._port = AsyncPort.open(self.portCOM, self.baudrate, self.silence)
+        return self._port.bus
+
+    def _blocking(self, *args, **kwargs):
+        raise NotImplementedError("blocking BMAC method on an AsyncBMAC: use await send, send_many, read or read_many")
+
+    submit = negotiate_baudrate = calibrate = tune_latency = _blocking
+
+    """
+    envoi d'une commande et attente de la réponse sans bloquer la boucle
+    """
+    async def send(self, lacommande):
+        reponse, duree = await self._exchange(self._frame(lacommande))
+        return decode_reply(reponse) if reponse != None else "SERIAL EXCEPTION"
+
+    """
+    envoi d'une série de commandes, chacune après la réponse de la précédente
+    (les autres instances du port peuvent s'intercaler); renvoie une liste de Reply
+    """
+    async def send_many(self, commandes, window=1):
+        resultats = []
+        for c in commandes:
+            reponse, duree = await self._exchange(self._frame(c))
+            resultats.append(Reply(c, decode_reply(reponse) if reponse != None else "SERIAL EXCEPTION", duree))
+        return resultats
+
+    """
+    lecture typée de registres déclarés dans self.registry (voir BMAC.read)
+    """
+    async def read(self, nom):
+        return (await self.read_many([nom]))[0]
+
+    async def read_many(self, noms, window=1):
+        valeurs = []
+        for nom in noms:
+            commande, decodeur = self._registre(nom)
+            reponse, duree = await self._exchange(commande.frame)
+            valeurs.append(self._valeur(decodeur, reponse) if reponse != None else "SERIAL EXCEPTION")
+        return valeurs
+
+    """
+    échange d'une trame; renvoie (réponse brute, durée en s), réponse None sur erreur série
+    """
+    async def _exchange(self, lacommande_bytes):
+        timeout = self.timeout
+        if timeout == None:
+            timeout = self.bus.timeouts.timeout(lacommande_bytes, self.bus.baudrate)
+        try:
+            reponse, debut = await self._port.exchange(lacommande_bytes, timeout)
         except serial.SerialException as e:
-            logging.error('serial error: ' + e)
-            return("SERIAL EXCEPTION")
-            
+            logging.error('serial error: ' + str(e))
+            if self.bus.subscribers:
+                maintenant = time.monotonic_ns()
+                self.bus._emit(lacommande_bytes, None, maintenant, maintenant)
+            return None, 0.0
+        fin = time.monotonic_ns()
+        self.bus.timeouts.observe(lacommande_bytes, reponse, (fin - debut) / 1e9, self.bus.baudrate)
+        if self.bus.subscribers:
+            self.bus._emit(lacommande_bytes, reponse, debut, fin)
+        return reponse, (fin - debut) / 1e9
+
+    """
+    libération du port (fermé avec sa dernière instance)
+    """
+    def close(self):
+        self._port.release()
+
+"""
+recherche des modules présents sur plusieurs ports série, tous sondés en parallèle
+(par défaut tous les ports FTDI 0403:60xx). les adresses actives sont trouvées
+par Bus.scan puis identifiées avec la commande Bus.IDENT.
+renvoie {port: {adresse: identité}}; l'identité vaut "SYNTAX ERROR" pour un module
+qui répond mais ne connaît pas la commande d'identification.
+latency est passé à Bus.scan: la valeur par défaut convient à un FTDI non réglé,
+0.001 divise la durée du sondage par 4 environ avec un latency_timer de 1 ms
+"""
+def discover(ports=None, addresses=range(100), baudrate=115200, latency=0.016, timeout=0.1):
+    if ports == None:
+        ports = [p.device for p in serial.tools.list_ports.grep("0403:60")]
+    if not ports:
+        return {}
+    with ThreadPoolExecutor(max_workers=len(ports)) as executor:
+        futures = {port: executor.submit(_probe_port, port, addresses, baudrate, latency, timeout) for port in ports}
+    return {port: f.result() for port, f in futures.items()}
+
+
+def _probe_port(port, addresses, baudrate, latency, timeout):
+    try:
+        bus = Bus(port, baudrate)    # bus privé, fermé après le sondage
+    except serial.SerialException as e:
+        logging.info(f"{port}: {e}")
+        return {}
+    try:
+        return {a: bus._query(Bus.IDENT, a, timeout) for a in bus.scan(addresses, latency=latency, timeout=timeout)}
+    finally:
+        bus.close()
+
+
+class Fleet:
+    """
+    ensemble de modules répartis sur plusieurs ports (un rack par port), commandés
+    en parallèle: un thread par port, les modules d'un même port à la suite.
+    la durée d'une opération sur tout le parc est celle du port le plus lent.
+    modules: liste de BMAC, ou {port: adresses} (par exemple le résultat de discover());
+    dans ce cas les ports que le parc ouvre sont fermés par close()
+    """
+    def __init__(self, modules, baudrate=115200):
+        self._buses = []    # bus ouverts par le parc, fermés avec lui
+        if isinstance(modules, dict):
+            with Bus._buses_lock:
+                deja_ouverts = set(Bus._buses)
+            modules = [BMAC(port, baudrate=baudrate, address=a) for port, adresses in modules.items() for a in adresses]
+            for bmac in modules:
+                if bmac.bus != None and bmac.portCOM not in deja_ouverts and bmac.bus not in self._buses:
+                    self._buses.append(bmac.bus)
+        self.modules = list(modules)
+        self._lignes = {}    # modules regroupés par bus
+        for bmac in self.modules:
+            self._lignes.setdefault(id(bmac.bus), []).append(bmac)
+        self._lignes = list(self._lignes.values())
+        self._executor = ThreadPoolExecutor(max_workers=max(1, len(self._lignes)), thread_name_prefix="fleet")
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    """
+    envoi d'une commande à tous les modules; renvoie {(port, adresse): réponse}
+    """
+    def send(self, lacommande):
+        return self._map(lambda bmac: bmac.send(lacommande))
+
+    """
+    envoi d'une série de commandes à tous les modules (BMAC.send_many);
+    renvoie {(port, adresse): [Reply, ...]}
+    """
+    def send_many(self, commandes, window=8):
+        commandes = list(commandes)
+        return self._map(lambda bmac: bmac.send_many(commandes, window))
+
+    def _map(self, fn):
+        futures = [self._executor.submit(lambda ligne: [(bmac, fn(bmac)) for bmac in ligne], ligne)
+                   for ligne in self._lignes]
+        return {(bmac.portCOM, bmac.address): r for f in futures for bmac, r in f.result()}
+
+    def close(self):
+        self._executor.shutdown()
+        for bus in self._buses:
+            bus.close()
+        self._buses = []
+
+
+class RingBuffer:
+    """
+    tampon circulaire préalloué d'échantillons (indice de la mesure, instant, valeur)
+    un seul thread écrit (append); les lecteurs ne prennent aucun verrou et
+    ne bloquent jamais l'écriture: ils détectent les échantillons écrasés entre-temps
+    """
+    def __init__(self, capacity):
+        self.capacity = capacity
+        self.index = array('i', bytes(4 * capacity))
+        self.stamps = array('d', bytes(8 * capacity))
+        self.values = array('d', bytes(8 * capacity))
+        self.count = 0    # nombre total d'échantillons écrits depuis la création
+
+    def append(self, index, stamp, value):
+        i = self.count % self.capacity
+        self.index[i] = index
+        self.stamps[i] = stamp
+        self.values[i] = value
+        self.count += 1    # publié après écriture complète de l'échantillon
+
+    """
+    lecture des échantillons écrits depuis le numéro since;
+    renvoie (numéro suivant, indices, instants, valeurs, nombre d'échantillons perdus)
+    """
+    def read(self, since=0):
+        fin = self.count
+        debut = max(since, fin - self.capacity)
+        index, stamps, values = self._copy(debut, fin)
+        # échantillons écrasés par l'écrivain pendant la copie
+        ecrases = max(0, self.count - self.capacity - debut)
+        if ecrases:
+            index, stamps, values = index[ecrases:], stamps[ecrases:], values[ecrases:]
+        return fin, index, stamps, values, debut - since + ecrases
+
+    def _copy(self, debut, fin):
+        i, j = debut % self.capacity, fin % self.capacity
+        if fin - debut == 0:
+            return array('i'), array('d'), array('d')
+        if i < j:
+            return self.index[i:j], self.stamps[i:j], self.values[i:j]
+        return (self.index[i:] + self.index[:j], self.stamps[i:] + self.stamps[:j],
+                self.values[i:] + self.values[:j])
+
+    """
+    dernière valeur d'une mesure (NaN si absente du tampon)
+    """
+    def latest(self, index):
+        fin = self.count
+        for n in range(fin - 1, max(-1, fin - self.capacity - 1), -1):
+            if self.index[n % self.capacity] == index:
+                return self.values[n % self.capacity]
+        return math.nan
+
+
+class Poller:
+    """
+    scrutation périodique de registres sur un ou plusieurs modules.
+    les cycles sont cadencés sur des échéances absolues (t0 + k * période): un
+    cycle en retard ne décale pas les suivants et les échéances dépassées sont
+    sautées (comptées dans missed). chaque valeur est convertie en nombre
+    (NaN si la réponse n'est pas numérique) et rangée avec l'instant de réception
+    (time.time) dans self.buffer, à la mesure d'indice sa position dans targets
+    """
+    def __init__(self, targets, rate, capacity=100000):
+        # targets: liste de (BMAC, commande), par exemple (my_bmac, "READ #POS")
+        self.targets = [(bmac, bmac.compile(lacommande)) for bmac, lacommande in targets]
+        self.period = 1 / rate
+        self.buffer = RingBuffer(capacity)
+        self.cycles = 0
+        self.missed = 0
+        self._groupes = {}    # commandes regroupées par module pour send_many
+        for k, (bmac, lacommande) in enumerate(self.targets):
+            self._groupes.setdefault(id(bmac), (bmac, [], []))
+            self._groupes[id(bmac)][1].append(k)
+            self._groupes[id(bmac)][2].append(lacommande)
+        self._stop = threading.Event()
+        self._thread = None
+
+    def start(self):
+        self._stop.clear()
+        self._thread = threading.Thread(target=self._run, name="poller", daemon=True)
+        self._thread.start()
+
+    def stop(self):
+        self._stop.set()
+        if self._thread != None:
+            self._thread.join()
+            self._thread = None
+
+    def _run(self):
+        t0 = time.monotonic()
+        k = 0
+        while not self._stop.wait(max(0.0, t0 + k * self.period - time.monotonic())):
+            self.poll()
+            self.cycles += 1
+            k += 1
+            retard = int((time.monotonic() - t0) / self.period) - k + 1
+            if retard > 0:    # échéances déjà dépassées: on les saute
+                self.missed += retard
+                k += retard
+
+    """
+    un cycle de lecture de toutes les mesures
+    """
+    def poll(self):
+        for bmac, indices, commandes in self._groupes.values():
+            resultats = bmac.send_many(commandes)
+            maintenant = time.time()
+            for k, r in zip(indices, resultats):
+                try:
+                    valeur = float(r.reply)
+                except ValueError:
+                    valeur = math.nan
+                self.buffer.append(k, maintenant, valeur)
+
+
+class Stream:
+    """
+    acquisition d'un module qui émet des trames de données en continu
+    ([STX][SIZ1..3][DATA][CHK1][CHK2][ETX], éventuellement précédées de [ACK][XON]
+    et suivies de [EOL]): un thread lit les octets dans un tampon préalloué
+    (readv sur le descripteur du port, readinto ailleurs), découpe les trames
+    au fil de l'eau et range chaque valeur dans self.buffer (RingBuffer, un seul
+    écrivain): indice = rang de la valeur dans la trame (valeurs séparées par
+    des espaces ou des virgules), instant de réception (time.time), valeur (NaN
+    si non numérique).
+    pendant l'acquisition le thread est seul propriétaire du bus: les autres
+    échanges sur le même port attendent stop(). start_command et stop_command
+    sont envoyées au module avant et après l'acquisition (par exemple
+    "WRITE #STREAM 1"). à l'arrêt la commande d'arrêt est envoyée alors que le
+    flux arrive encore: sa réponse est cherchée parmi les trames de données
+    (stop_reply, "COM ERROR" si elle n'arrive pas), puis la fin du flux est
+    écartée jusqu'au silence de la ligne avant de rendre le bus.
+    compteurs: frames, bad (checksum ou fin de trame incorrecte), garbage
+    (octets hors trame), overruns (échantillons écrasés avant d'avoir été lus)
+    """
+    def __init__(self, bmac, start_command=None, stop_command=None, capacity=100000, chunk=4096):
+        self.bmac = bmac
+        self.bus = bmac.bus
+        self.start_command = start_command
+        self.stop_command = stop_command
+        self.buffer = RingBuffer(capacity)
+        self._buf = bytearray(chunk)
+        self.frames = 0
+        self.bad = 0
+        self.garbage = 0
+        self.overruns = 0
+        self.stop_reply = None    # réponse à stop_command, au format de BMAC.send
+        self._since = 0
+        self._stop = threading.Event()
+        self._thread = None
+
+    def __enter__(self):
+        self.start()
+        return self
+
+    def __exit__(self, *exc):
+        self.stop()
+
+    def start(self):
+        if self.start_command != None:
+            self.bmac.send(self.start_command)
+        self.bus.stop()    # le thread d'E/S éventuel rend le port
+        self.bus.lock.acquire()
+        self._stop.clear()
+        self._thread = threading.Thread(target=self._run, name=f"stream {self.bus.portCOM}", daemon=True)
+        self._thread.start()
+
+    def stop(self):
+        if self._thread == None:
+            return
+        self._stop.set()
+        self._thread.join()
+        self._thread = None
+        self.bus.stale = True    # le flux arrive encore: rien ne doit être pris pour une réponse
+        try:
+            if self.stop_command != None:
+                self.stop_reply = self._send_stop()
+                if self.stop_reply != "OK":
+                    logging.error(f"{self.bus.portCOM}: stream stop command: {self.stop_reply}")
+            if not self.bus.settle():    # fin du flux encore en route
+                logging.error(f"{self.bus.portCOM}: stream still running after stop")
+            self.bus.resync()
+        except serial.SerialException as e:
+            logging.error('serial error: ' + str(e))
+        finally:
+            self.bus.lock.release()
+
+    """
+    envoi de la commande d'arrêt (bus verrouillé): les trames de données qui
+    précèdent son acquittement sont ignorées
+    """
+    def _send_stop(self):
+        trame = self.bmac._frame(self.stop_command)
+        self.bus.resync()
+        self.bus.ser.write(trame)
+        timeout = self.bmac.timeout or self.bus.timeouts.timeout(trame, self.bus.baudrate)
+        deadline = time.monotonic() + timeout
+        parser = FrameParser()
+        while time.monotonic() < deadline:
+            if not self.bus._read_step(parser, deadline):
+                continue
+            while parser.frames:
+                reponse = parser.pop()
+                if reply_status(reponse) != "DATA":    # acquittement, erreur ou échéance
+                    return decode_reply(reponse)
+        return "COM ERROR"
+
+    """
+    lecture des échantillons reçus depuis le dernier appel (voir RingBuffer.read);
+    renvoie (indices, instants, valeurs), les échantillons perdus sont comptés dans overruns
+    """
+    def read(self):
+        self._since, index, stamps, values, perdus = self.buffer.read(self._since)
+        self.overruns += perdus
+        return index, stamps, values
+
+    def _run(self):
+        ser = self.bus.ser
+        fd = getattr(ser, 'fd', None)    # descripteur POSIX de pyserial
+        vue = memoryview(self._buf)
+        n = 0
+        while not self._stop.is_set():
+            if n == len(self._buf):    # tampon plein sans fin de trame
+                self.garbage += n
+                n = 0
+            try:
+                if fd != None:
+                    if not select.select([fd], [], [], self.bus.silence)[0]:
+                        continue
+                    lu = os.readv(fd, [vue[n:]])
+                else:
+                    lu = ser.readinto(vue[n:n + max(1, ser.in_waiting)])
+            except BlockingIOError:
+                continue
+            except (OSError, serial.SerialException) as e:
+                logging.error('serial error: ' + str(e))
+                return
+            if lu:
+                n += lu
+                fin = self._parse(n, time.time())
+                if fin:
+                    self._buf[:n - fin] = self._buf[fin:n]    # reste d'une trame incomplète en tête
+                    n -= fin
+
+    """
+    découpage des trames complètes de self._buf[:n]; renvoie la position du premier octet non traité
+    """
+    def _parse(self, n, stamp):
+        buf = self._buf
+        i = 0
+        while True:
+            debut = buf.find(ord(STX), i, n)
+            if debut == -1:
+                self.garbage += sum(b not in (ACK, XON, 0x0a) for b in buf[i:n])
+                return n
+            self.garbage += sum(b not in (ACK, XON, 0x0a) for b in buf[i:debut])
+            if debut + 4 > n:
+                return debut
+            try:
+                taille = int(buf[debut + 1:debut + 4])
+            except ValueError:
+                self.bad += 1
+                i = debut + 1
+                continue
+            fin = debut + 4 + taille + 3
+            if fin > n:
+                return debut
+            data = buf[debut + 4:fin - 3]
+            if buf[fin - 1] != ord(ETX) or b'%02X' % (sum(data) % 256) != buf[fin - 3:fin - 1]:
+                self.bad += 1
+                i = debut + 1    # recherche du début de trame suivant
+                continue
+            for k, champ in enumerate(data.replace(b',', b' ').split()):
+                try:
+                    valeur = float(champ)
+                except ValueError:
+                    valeur = math.nan
+                self.buffer.append(k, stamp, valeur)
+            self.frames += 1
+            i = fin
+
+
+class ArrayReader:
+    """
+    lecture groupée de mesures numériques directement dans des tableaux préalloués
+    (NumPy si disponible, sinon array.array à plat, ligne après ligne).
+    les réponses brutes sont converties sans passer par decode_reply; une réponse
+    non numérique ou en erreur donne NaN. chaque valeur est accompagnée de
+    l'instant de réception de sa réponse (time.time)
+    """
+    def __init__(self, targets, window=8):
+        # targets: liste de (BMAC, commande); la colonne k correspond à targets[k]
+        self.columns = len(targets)
+        self.window = window
+        self._groupes = {}    # trames regroupées par module, envoyées en une transaction
+        for k, (bmac, lacommande) in enumerate(targets):
+            groupe = self._groupes.setdefault(id(bmac), (bmac, [], []))
+            groupe[1].append(k)
+            groupe[2].append(bmac.compile(lacommande).frame)
+        self._groupes = list(self._groupes.values())
+
+    """
+    allocation de tableaux (samples lignes, une colonne par mesure) remplis de NaN
+    """
+    def allocate(self, samples):
+        if numpy is not None:
+            return (numpy.full((samples, self.columns), math.nan),
+                    numpy.full((samples, self.columns), math.nan))
+        return (array('d', [math.nan]) * (samples * self.columns),
+                array('d', [math.nan]) * (samples * self.columns))
+
+    """
+    lecture de toutes les mesures dans la ligne row de values/stamps
+    """
+    def read(self, values, stamps, row=0):
+        values, stamps = _flat(values), _flat(stamps)
+        base = row * self.columns
+        decalage = time.time() - time.monotonic()    # conversion des instants monotones en heure
+        for bmac, colonnes, trames in self._groupes:
+            t = bmac.bus.transact(trames, self.window, bmac.timeout)
+            for k, (reponse, duree), t_envoi in zip(colonnes, t.reponses, t.t_envoi):
+                if reply_status(reponse) == "DATA":
+                    try:
+                        values[base + k] = float(reponse[REPLY_HEADER:-REPLY_TRAILER])
+                    except ValueError:
+                        values[base + k] = math.nan
+                else:
+                    values[base + k] = math.nan
+                stamps[base + k] = t_envoi + duree + decalage
+            if t.error != None:
+                logging.error('serial error: ' + str(t.error))
+                for k in colonnes[len(t.reponses):]:
+                    values[base + k] = math.nan
+
+    """
+    acquisition de samples lignes consécutives; renvoie (values, stamps)
+    """
+    def acquire(self, samples, values=None, stamps=None):
+        if values is None or stamps is None:    # (comparaison == élément par élément avec NumPy)
+            values, stamps = self.allocate(samples)
+        for row in range(samples):
+            self.read(values, stamps, row)
+        return values, stamps
+
+
+"""
+vue à une dimension d'un tableau NumPy contigu (les array.array sont déjà à plat)
+"""
+def _flat(tableau):
+    if hasattr(tableau, 'reshape'):
+        if not tableau.flags.c_contiguous:
+            raise ValueError("array must be C-contiguous")
+        return tableau.reshape(-1)
+    return tableau
+
+
+class Script:
+    """
+    exécution d'un fichier de commandes (.bms), une instruction par ligne:
+        # commentaire                   (# suivi d'un espace, ou //: #SPEED=200 est une commande)
+        READ #STATUS                    commande envoyée au module ($nom: variable)
+        SET nom valeur                  affectation d'une variable
+        REPEAT n [AS i] ... END         répétition d'un bloc (i: numéro de tour, 0..n-1)
+        DELAY ms                        pause
+        WAIT commande op valeur [TIMEOUT ms]   relance la commande jusqu'à ce que
+                                        réponse op valeur soit vrai (op: == != < > <= >=)
+        ADDRESS n                       module destinataire des commandes suivantes
+        PRINT texte
+    les lectures consécutives (READ ...) sont envoyées en flux continu (BMAC.send_many),
+    les autres commandes une par une, chacune après la réponse de la précédente;
+    chaque étape est affichée avec sa réponse et sa durée
+    """
+    OPERATEURS = {
+        '==': lambda a, b: a == b, '!=': lambda a, b: a != b,
+        '<': lambda a, b: a < b, '>': lambda a, b: a > b,
+        '<=': lambda a, b: a <= b, '>=': lambda a, b: a >= b,
+    }
+    WAIT = re.compile(r'WAIT\s+(.+?)\s*(==|!=|<=|>=|<|>)\s*(\S+)(?:\s+TIMEOUT\s+(\S+))?$', re.IGNORECASE)
+    COMMENT = re.compile(r'#(\s|$)|//')
+    READ = re.compile(r'READ\s', re.IGNORECASE)
+
+    def __init__(self, text, bmac, out=print):
+        self.bmac = bmac
+        self.out = out
+        self.variables = {}
+        self.errors = 0
+        lignes = [(n + 1, l.strip()) for n, l in enumerate(text.splitlines())]
+        self.steps = self._parse([(n, l) for n, l in lignes if l and not self.COMMENT.match(l)], 0)[0]
+
+    @classmethod
+    def load(cls, path, bmac, out=print):
+        with open(path) as f:
+            return cls(f.read(), bmac, out)
+
+    """
+    analyse des lignes à partir de l'indice i jusqu'au END du bloc; renvoie (étapes, indice suivant)
+    """
+    def _parse(self, lignes, i, bloc=None):
+        etapes = []
+        while i < len(lignes):
+            n, ligne = lignes[i]
+            mot = ligne.split()[0].upper()
+            i += 1
+            if mot == 'END':
+                if bloc == None:
+                    raise ValueError(f"line {n}: END without REPEAT")
+                return etapes, i
+            if mot == 'REPEAT':
+                args = ligne.split()
+                if len(args) not in (2, 4) or (len(args) == 4 and args[2].upper() != 'AS'):
+                    raise ValueError(f"line {n}: REPEAT n [AS var]")
+                corps, i = self._parse(lignes, i, n)
+                etapes.append(('repeat', n, args[1], args[3] if len(args) == 4 else None, corps))
+            elif mot == 'WAIT':
+                m = self.WAIT.match(ligne)
+                if not m:
+                    raise ValueError(f"line {n}: WAIT command op value [TIMEOUT ms]")
+                etapes.append(('wait', n) + m.groups())
+            elif mot in ('SET', 'DELAY', 'ADDRESS', 'PRINT'):
+                etapes.append((mot.lower(), n, ligne[len(mot):].strip()))
+            else:
+                etapes.append(('command', n, ligne))
+        if bloc != None:
+            raise ValueError(f"line {bloc}: REPEAT without END")
+        return etapes, i
+
+    def _subst(self, texte):
+        return re.sub(r'\$\{?(\w+)\}?', lambda m: str(self.variables.get(m.group(1), m.group(0))), texte)
+
+    @staticmethod
+    def _nombre(texte):
+        try:
+            return int(texte)
+        except ValueError:
+            try:
+                return float(texte)
+            except ValueError:
+                return texte
+
+    """
+    exécution du script; renvoie le nombre de réponses en erreur
+    """
+    def run(self):
+        debut = time.perf_counter()
+        self._run(self.steps)
+        self.out(f"total {(time.perf_counter() - debut) * 1000:.1f} ms, {self.errors} error(s)")
+        return self.errors
+
+    def _run(self, etapes):
+        lot = []    # commandes consécutives, envoyées ensemble
+        for etape in etapes + [None]:
+            if etape != None and etape[0] == 'command':
+                lot.append(etape)
+                continue
+            if lot:
+                self._commands(lot)
+                lot = []
+            if etape == None:
+                break
+            genre, n = etape[0], etape[1]
+            if genre == 'repeat':
+                for k in range(int(self._subst(etape[2]))):
+                    if etape[3] != None:
+                        self.variables[etape[3]] = k
+                    self._run(etape[4])
+            elif genre == 'set':
+                nom, _, valeur = etape[2].partition(' ')
+                self.variables[nom] = self._nombre(self._subst(valeur.strip().lstrip('=').strip()))
+            elif genre == 'delay':
+                ms = float(self._subst(etape[2]))
+                time.sleep(ms / 1000)
+                self.out(f"{n:4} DELAY {ms:g} ms")
+            elif genre == 'address':
+                self.bmac = BMAC(bus=self.bmac.bus, address=int(self._subst(etape[2])), timeout=self.bmac.timeout)
+            elif genre == 'print':
+                self.out(self._subst(etape[2]))
+            elif genre == 'wait':
+                self._wait(n, *etape[2:])
+
+    def _commands(self, lot):
+        commandes = [self._subst(ligne) for _, _, ligne in lot]
+        i = 0
+        while i < len(commandes):    # suites de lectures en flux continu, le reste une à une
+            lecture = bool(self.READ.match(commandes[i]))
+            j = i + 1
+            while j < len(commandes) and lecture and self.READ.match(commandes[j]):
+                j += 1
+            for (_, n, _), r in zip(lot[i:j], self.bmac.send_many(commandes[i:j], 8 if lecture else 1)):
+                self.errors += r.reply in ("COM ERROR", "SYNTAX ERROR", "SERIAL EXCEPTION")
+                self.out(f"{n:4} {r.command:<30} {r.reply:<20} {r.elapsed * 1000:8.3f} ms")
+            i = j
+
+    def _wait(self, n, lacommande, op, valeur, timeout):
+        lacommande = self._subst(lacommande)
+        attendu = self._nombre(self._subst(valeur))
+        limite = float(self._subst(timeout)) / 1000 if timeout else 10.0
+        debut = time.perf_counter()
+        while True:
+            reponse = self.bmac.send(lacommande)
+            lu = self._nombre(reponse)
+            try:
+                ok = self.OPERATEURS[op](lu, attendu)
+            except TypeError:    # comparaison d'un nombre et d'un texte
+                ok = False
+            duree = time.perf_counter() - debut
+            if ok or duree >= limite:
+                break
+            time.sleep(0.01)
+        if not ok:
+            self.errors += 1
+        self.out(f"{n:4} WAIT {lacommande} {op} {attendu} -> {reponse} {'' if ok else 'TIMEOUT '}{duree * 1000:8.3f} ms")
 
-        if reponse.find(b'\x06') == -1: # pas de STX: le module n'acquitte pas la réponse
-            return("COM ERROR")
-        elif reponse.find(b'\x18') != -1: # pas de XOFFerror: la commande n'a pas été correctement interprétée
-            return("SYNTAX ERROR")
-        elif reponse.find(b'\x1a') == -1: # pas de XON: il s'agit d'une commande, le module acquitte sans répondre
-            return("OK")
-        else:
-            return(reponse[6:-4].decode('ascii')) # décodage de la réponse (on ignore les caractères de 'protocole')
 
 """
 exemple d'utilisation
@@ -110,15 +2251,48 @@ if __name__ == '__main__':
         sys.exit(1)
 
     logging.basicConfig(level=logging.ERROR) # logging.ERROR ou logging.INFO
+
+    # python pyshell.py [run fichier.bms] [--port COM2] [--baudrate 115200] [--address 0]
+    # python pyshell.py latency [--latency-timer 1]    réglages FTDI et aller-retour mesuré
+    import argparse
+    parser = argparse.ArgumentParser()
+    parser.add_argument("action", nargs="?", choices=["run", "latency"])
+    parser.add_argument("script", nargs="?")
+    parser.add_argument("--port", default="COM2")
+    parser.add_argument("--baudrate", type=int, default=115200)
+    parser.add_argument("--address", type=int, default=0)
+    parser.add_argument("--capture", help="enregistrement des échanges dans ce fichier (voir bmac_replay.py)")
+    parser.add_argument("--latency-timer", type=int, help="latency_timer FTDI à régler (ms) avec ASYNC_LOW_LATENCY, pour l'action latency")
+    args = parser.parse_args()
     
-    my_bmac = BMAC("COM2",baudrate=115200,address=0)
-    
-    while True:
-        cmd = input("->>")    # saisir la commande à envoyer à la carte, exemple: READ #STATUS
-        if cmd=="quit":
-            exit()
-        else:
-            la_reponse = my_bmac.send(cmd)
-            print(la_reponse)
+    my_bmac = BMAC(args.port,baudrate=args.baudrate,address=args.address)
+    if logging.getLogger().isEnabledFor(logging.INFO):
+        my_bmac.subscribe(log_subscriber) # trace des trames échangées
+    capture = None
+    if args.capture:
+        capture = Capture(args.capture)
+        my_bmac.subscribe(capture)
+
+    try:
+        if args.action == "run":    # exécution d'un fichier de commandes
+            sys.exit(1 if Script.load(args.script, my_bmac).run() else 0)
+
+        if args.action == "latency":    # vérification du réglage de l'adaptateur sur ce poste
+            print("before:", my_bmac.calibrate())
+            if args.latency_timer != None:
+                print("after: ", my_bmac.tune_latency(args.latency_timer))
+            sys.exit(0)
+
+        while True:
+            cmd = input("->>")    # saisir la commande à envoyer à la carte, exemple: READ #STATUS
+            if cmd=="quit":
+                exit()
+            else:
+                la_reponse = my_bmac.send(cmd)
+                print(la_reponse)
+    finally:
+        if capture != None:    # enregistrements encore en tampon écrits sur le disque
+            my_bmac.unsubscribe(capture)
+            capture.close()
             
             
@@ -0,0 +1,15 @@
+#!/usr/bin/env python
+# -*- coding:utf-8 -*-
+
+# compilation de l'accélérateur optionnel (pyshell fonctionne sans):
+#   python setup.py build_ext --inplace
+
+from setuptools import setup, Extension
+
+setup(
+    name="pyshell",
+    version="5.1",
+    py_modules=["pyshell", "bmac_sim", "bmac_bench", "bmac_replay"],
+    ext_modules=[Extension("_pyshell_accel", ["_pyshell_accel.c"], optional=True)],
+    install_requires=["pyserial"],
+)